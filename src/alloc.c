@@ -1,9 +1,179 @@
 #include "alloc.h"
 
-unsigned long int useMemory = 0;
+#include <pthread.h>
 
-unsigned long int
+__thread MemThread memLocal = { { 0 }, { 0 }, 0, 0, 0, NULL };
+__thread int memThreadTag = -1;
+int memStage = MEM_TAG_OTHER;
+
+static long memUsage[MEM_TAGS];
+static long memPeaks[MEM_TAGS];
+static long memTotal = 0;
+static long memTotalPeak = 0;
+static int memFinished = 0;
+
+// threads with deltas that are not folded yet
+static MemThread* memThreads = NULL;
+static pthread_mutex_t memLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t memKey;
+static pthread_once_t memKeyOnce = PTHREAD_ONCE_INIT;
+
+static const char* memTagNames[MEM_TAGS]
+    = { "other", "index", "query kmers", "segments", "pair matrix", "io" };
+
+static inline void
+memRaise(long* peak, long value)
+{
+  long old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while (value > old
+         && !__atomic_compare_exchange_n(peak, &old, value, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// move the deltas of local to the shared counters, raising the peaks by
+// the highest the deltas went; the caller holds memLock or owns local
+static void
+memFlush(MemThread* local)
+{
+  long total = 0;
+  for (int tag = 0; tag < MEM_TAGS; tag++) {
+    long delta = local->delta[tag];
+    long high = local->high[tag];
+    if (delta == 0 && high == 0) {
+      continue;
+    }
+    __atomic_store_n(local->delta + tag, 0, __ATOMIC_RELAXED);
+    local->high[tag] = 0;
+    long old = __atomic_fetch_add(memUsage + tag, delta, __ATOMIC_RELAXED);
+    memRaise(memPeaks + tag, old + high);
+    total += delta;
+  }
+  long high = local->highPending;
+  __atomic_store_n(&local->pending, 0, __ATOMIC_RELAXED);
+  local->highPending = 0;
+  long old = __atomic_fetch_add(&memTotal, total, __ATOMIC_RELAXED);
+  memRaise(&memTotalPeak, old + high);
+}
+
+static void
+memExit(void* arg)
+{
+  MemThread* local = arg;
+  pthread_mutex_lock(&memLock);
+  memFlush(local);
+  for (MemThread** p = &memThreads; *p; p = &(*p)->next) {
+    if (*p == local) {
+      *p = local->next;
+      break;
+    }
+  }
+  local->registered = 0;
+  pthread_mutex_unlock(&memLock);
+}
+
+static void
+memKeyInit()
+{
+  pthread_key_create(&memKey, memExit);
+}
+
+void
+memFold(MemThread* local)
+{
+  pthread_mutex_lock(&memLock);
+  if (!local->registered) {
+    // fold what is left when the thread exits
+    pthread_once(&memKeyOnce, memKeyInit);
+    pthread_setspecific(memKey, local);
+    local->next = memThreads;
+    memThreads = local;
+    local->registered = 1;
+  }
+  memFlush(local);
+  pthread_mutex_unlock(&memLock);
+}
+
+// shared counter of tag plus the deltas of every live thread; tag MEM_TAGS
+// sums all tags. It is negative if memory was freed under another tag than
+// it was allocated with.
+static long
+memRead(int tag)
+{
+  pthread_mutex_lock(&memLock);
+  long used = __atomic_load_n(tag < MEM_TAGS ? memUsage + tag : &memTotal,
+                              __ATOMIC_RELAXED);
+  for (MemThread* t = memThreads; t; t = t->next) {
+    used += tag < MEM_TAGS ? __atomic_load_n(t->delta + tag, __ATOMIC_RELAXED)
+                           : __atomic_load_n(&t->pending, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&memLock);
+  return used;
+}
+
+long
 getUsedMemory()
 {
-  return useMemory;
+  return memRead(MEM_TAGS);
+}
+
+long
+memUsed(MemTag tag)
+{
+  return memRead(tag);
+}
+
+unsigned long int
+memPeak(MemTag tag)
+{
+  long peak = __atomic_load_n(memPeaks + tag, __ATOMIC_RELAXED);
+  long used = memUsed(tag);
+  return used > peak ? used : (peak > 0 ? peak : 0);
+}
+
+unsigned long int
+memPeakTotal()
+{
+  long peak = __atomic_load_n(&memTotalPeak, __ATOMIC_RELAXED);
+  long used = getUsedMemory();
+  return used > peak ? used : (peak > 0 ? peak : 0);
+}
+
+const char*
+memTagName(MemTag tag)
+{
+  return memTagNames[tag];
+}
+
+// the program freed everything it allocated, so memReport() warns about
+// what any tag still holds
+void
+memFinish()
+{
+  memFinished = 1;
+}
+
+void
+memReport()
+{
+  info("memory peak %.2f MB, %.2f MB still in use",
+       memPeakTotal() / 1024.0 / 1024.0, getUsedMemory() / 1024.0 / 1024.0);
+  for (int tag = 0; tag < MEM_TAGS; tag++) {
+    long used = memUsed(tag);
+    if (used < 0) {
+      warn("memory accounting of %s is %ld bytes below zero, some of it was "
+           "freed under another tag",
+           memTagName(tag), -used);
+    } else if (used > 0 && memFinished) {
+      warn("memory accounting of %s is %ld bytes above zero, some of it was "
+           "not freed or freed under another tag",
+           memTagName(tag), used);
+    }
+    unsigned long int peak = memPeak(tag);
+    if (peak == 0) {
+      continue;
+    }
+    info("  %-12s peak %10.2f MB, in use %10.2f MB", memTagName(tag),
+         peak / 1024.0 / 1024.0, used / 1024.0 / 1024.0);
+  }
 }
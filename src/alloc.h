@@ -3,6 +3,7 @@
 #include "log.h"
 
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #ifdef __SIZE_TYPE__
@@ -11,71 +12,171 @@ typedef __SIZE_TYPE__ size_t;
 typedef unsigned long size_t;
 #endif
 
-extern unsigned long int useMemory;
-extern unsigned long int getUsedMemory();
+// Memory accounting. Every allocation is charged to a tag: the one given
+// to the *Tag variants, else the tag of the calling thread, set with
+// memSetThreadTag(), else the stage the program is in, set with memSetTag().
+// The stage is changed by the main thread between steps, so OpenMP workers
+// follow it; threads that run beside the main thread, such as readers, set
+// their own tag when they start. Threads keep their own running deltas and
+// fold them into the shared atomic counters once MEM_FOLD_BYTES have piled
+// up, so the hot path takes no lock and no atomic read-modify-write: only
+// the owner writes its deltas, with relaxed stores that readers on other
+// threads load. Each thread remembers how far its deltas rose since the
+// last fold, so its transient peaks still reach the high-water marks.
+// Readers add the unfolded deltas of all live threads; a thread folds what
+// is left when it exits.
 
-static inline unsigned long int
+typedef enum {
+  MEM_TAG_OTHER,
+  MEM_TAG_INDEX,   // kmer indexes
+  MEM_TAG_QUERY,   // query records and their kmers
+  MEM_TAG_SEGMENT, // candidate segments and circles
+  MEM_TAG_PAIR,    // pair check matrix
+  MEM_TAG_IO,      // read, read-ahead and output buffers
+  MEM_TAGS,
+} MemTag;
+
+#define MEM_FOLD_BYTES (1L << 20) // 1MB
+
+typedef struct MemThread MemThread;
+struct MemThread {
+  long delta[MEM_TAGS]; // not folded yet
+  long high[MEM_TAGS];  // highest delta since the last fold
+  long pending;         // sum of delta
+  long highPending;     // highest pending since the last fold
+  int registered;
+  MemThread* next;
+};
+
+extern __thread MemThread memLocal;
+extern __thread int memThreadTag;
+extern int memStage;
+
+extern void memFold(MemThread* local);
+extern long getUsedMemory();
+extern long memUsed(MemTag tag);
+extern unsigned long int memPeak(MemTag tag);
+extern unsigned long int memPeakTotal();
+extern const char* memTagName(MemTag tag);
+extern void memFinish();
+extern void memReport();
+
+// charge size bytes, negative when freed, to tag
+static inline void
+memAccount(MemTag tag, long size)
+{
+  MemThread* local = &memLocal;
+  long delta = local->delta[tag] + size;
+  long pending = local->pending + size;
+  __atomic_store_n(local->delta + tag, delta, __ATOMIC_RELAXED);
+  __atomic_store_n(&local->pending, pending, __ATOMIC_RELAXED);
+  if (delta > local->high[tag]) {
+    local->high[tag] = delta;
+  }
+  if (pending > local->highPending) {
+    local->highPending = pending;
+  }
+  if (pending >= MEM_FOLD_BYTES || pending <= -MEM_FOLD_BYTES
+      || !local->registered) {
+    memFold(local);
+  }
+}
+
+// the tag of allocations that do not name one; returns the previous tag so
+// a stage can restore it when it ends
+static inline MemTag
+memSetTag(MemTag tag)
+{
+  return (MemTag)__atomic_exchange_n(&memStage, tag, __ATOMIC_RELAXED);
+}
+
+// the tag of allocations the calling thread makes without naming one,
+// whatever the stage; a negative tag follows the stage again
+static inline int
+memSetThreadTag(int tag)
+{
+  int old = memThreadTag;
+  memThreadTag = tag;
+  return old;
+}
+
+static inline MemTag
+memTag()
+{
+  if (memThreadTag >= 0) {
+    return (MemTag)memThreadTag;
+  }
+  return (MemTag)__atomic_load_n(&memStage, __ATOMIC_RELAXED);
+}
+
+static inline long
 getUsedMemoryKB()
 {
   return getUsedMemory() / 1024;
 }
 
-static inline unsigned long int
+static inline long
 getUsedMemoryMB()
 {
   return getUsedMemory() / 1024 / 1024;
 }
 
-static inline unsigned long int
+static inline long
 getUsedMemoryGB()
 {
   return getUsedMemory() / 1024 / 1024 / 1024;
 }
 
-// void *dmalloc(size_t size);
-#define dmalloc(size)                                                         \
+// void *dmallocTag(size_t size, MemTag tag);
+#define dmallocTag(size, tag)                                                 \
   ({                                                                          \
     void* ptr = malloc(size);                                                 \
     if (ptr == NULL) {                                                        \
       fprintf(stderr, "malloc failed. %s:%d\n", __FILE__, __LINE__);          \
       exit(1);                                                                \
     }                                                                         \
-    useMemory += (size);                                                      \
+    memAccount((tag), (long)(size));                                          \
     ptr;                                                                      \
   })
 
-// void *drealloc(void *ptr, size_t old_size, size_t size);
-#define drealloc(ptr, old_size, size)                                         \
+// void *dreallocTag(void *ptr, size_t old_size, size_t size, MemTag tag);
+#define dreallocTag(ptr, old_size, size, tag)                                 \
   ({                                                                          \
     void* new_ptr = realloc(ptr, size);                                       \
     if (new_ptr == NULL) {                                                    \
       fprintf(stderr, "realloc failed. %s:%d\n", __FILE__, __LINE__);         \
       exit(1);                                                                \
     }                                                                         \
-    useMemory += (size) - (old_size);                                         \
+    memAccount((tag), (long)((size_t)(size) - (size_t)(old_size)));           \
     new_ptr;                                                                  \
   })
 
-// void dfree(void *ptr, size_t size);
-
-#define dfree(ptr, size)                                                      \
+// void dfreeTag(void *ptr, size_t size, MemTag tag);
+#define dfreeTag(ptr, size, tag)                                              \
   if ((ptr) != NULL) {                                                        \
-    useMemory -= (size);                                                      \
+    memAccount((tag), -(long)(size));                                         \
     free((ptr));                                                              \
   }
 
-// void *dcalloc(size_t nmemb, size_t size);
-#define dcalloc(nmemb, size)                                                  \
+// void *dcallocTag(size_t nmemb, size_t size, MemTag tag);
+#define dcallocTag(nmemb, size, tag)                                          \
   ({                                                                          \
     void* ptr = calloc(nmemb, size);                                          \
     if (ptr == NULL) {                                                        \
       fprintf(stderr, "calloc failed. %s:%d\n", __FILE__, __LINE__);          \
       exit(1);                                                                \
     }                                                                         \
-    useMemory += (size);                                                      \
+    memAccount((tag), (long)(nmemb) * (long)(size));                          \
     ptr;                                                                      \
   })
 
+// the same, charged to the current stage
+#define dmalloc(size) dmallocTag(size, memTag())
+#define drealloc(ptr, old_size, size)                                         \
+  dreallocTag(ptr, old_size, size, memTag())
+#define dfree(ptr, size) dfreeTag(ptr, size, memTag())
+#define dcalloc(nmemb, size) dcallocTag(nmemb, size, memTag())
+
 #define roundup(x)                                                            \
   ({                                                                          \
     uint64_t __x = (x);                                                       \
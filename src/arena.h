@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "alloc.h"
+
+// Region allocator for memory that dies together. Allocations are bumped
+// out of large chunks and never freed one by one: arenaReset() rewinds the
+// arena, keeping its chunks for the next round, and arenaFree() returns
+// them all. Chunks are charged to the memory tag that was current when the
+// arena was made. An arena is not thread safe; give each thread its own.
+
+#define ARENA_ALIGN 16
+
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+  ArenaChunk* next;
+  size_t size;
+  size_t used;
+  _Alignas(ARENA_ALIGN) char data[];
+};
+
+typedef struct {
+  ArenaChunk* chunks; // oldest first
+  ArenaChunk* chunk;  // the one being filled
+  size_t chunk_size;  // of regular chunks, larger requests get their own
+  MemTag tag;
+} Arena;
+
+static inline Arena*
+arenaNew(size_t chunk_size)
+{
+  Arena* arena = dmalloc(sizeof(Arena));
+  arena->chunks = NULL;
+  arena->chunk = NULL;
+  arena->chunk_size = chunk_size;
+  arena->tag = memTag();
+  return arena;
+}
+
+// forget every allocation, keep the chunks
+static inline void
+arenaReset(Arena* arena)
+{
+  arena->chunk = arena->chunks;
+  if (arena->chunk) {
+    arena->chunk->used = 0;
+  }
+}
+
+static inline void
+arenaFree(Arena* arena)
+{
+  if (arena == NULL) {
+    return;
+  }
+  ArenaChunk* chunk = arena->chunks;
+  while (chunk) {
+    ArenaChunk* next = chunk->next;
+    dfreeTag(chunk, sizeof(ArenaChunk) + chunk->size, arena->tag);
+    chunk = next;
+  }
+  dfreeTag(arena, sizeof(Arena), arena->tag);
+}
+
+// size bytes aligned to ARENA_ALIGN, reusing the chunks of earlier rounds
+// first
+static inline void*
+arenaAlloc(Arena* arena, size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  ArenaChunk* chunk = arena->chunk;
+  while (chunk && chunk->used + size > chunk->size && chunk->next) {
+    chunk = chunk->next;
+    chunk->used = 0;
+  }
+  if (chunk == NULL || chunk->used + size > chunk->size) {
+    size_t cap = size > arena->chunk_size ? size : arena->chunk_size;
+    ArenaChunk* fresh = dmallocTag(sizeof(ArenaChunk) + cap, arena->tag);
+    fresh->next = NULL;
+    fresh->size = cap;
+    fresh->used = 0;
+    if (chunk) {
+      chunk->next = fresh;
+    } else {
+      arena->chunks = fresh;
+    }
+    chunk = fresh;
+  }
+  arena->chunk = chunk;
+  void* ptr = chunk->data + chunk->used;
+  chunk->used += size;
+  return ptr;
+}
+
+// Resize ptr, the last allocation made, from old_size to size bytes and
+// return where it is now. It grows in place while its chunk has room; one
+// that has the last chunk to itself is reallocated with it, else it moves
+// to the next chunk. Shrinking gives the tail back.
+static inline void*
+arenaGrow(Arena* arena, void* ptr, size_t old_size, size_t size)
+{
+  old_size = (old_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  ArenaChunk* chunk = arena->chunk;
+  if (chunk->used - old_size + size <= chunk->size) {
+    chunk->used = chunk->used - old_size + size;
+    return ptr;
+  }
+  if ((char*)ptr == chunk->data && chunk->next == NULL) {
+    ArenaChunk** link = &arena->chunks;
+    while (*link != chunk) {
+      link = &(*link)->next;
+    }
+    // dreallocTag reads its size arguments after the realloc
+    size_t bytes = sizeof(ArenaChunk) + chunk->size;
+    chunk = dreallocTag(chunk, bytes, sizeof(ArenaChunk) + size, arena->tag);
+    chunk->size = size;
+    chunk->used = size;
+    *link = chunk;
+    arena->chunk = chunk;
+    return chunk->data;
+  }
+  void* moved = arenaAlloc(arena, size);
+  memcpy(moved, ptr, old_size);
+  return moved;
+}
+
+static inline void*
+arenaCalloc(Arena* arena, size_t nmemb, size_t size)
+{
+  void* ptr = arenaAlloc(arena, nmemb * size);
+  memset(ptr, 0, nmemb * size);
+  return ptr;
+}
@@ -19,18 +19,11 @@
     break;                                                                    \
   }
 
+// "-" is a valid value: it names stdin or stdout
 #define arglost_value(argv, offset, argname, count)                           \
   if (offset + count >= argc) {                                               \
     printf("%s requires %d arguments\n", argname, count);                     \
     exit(1);                                                                  \
-  }                                                                           \
-  if (offset + count >= argc) {                                               \
-    printf("%s requires %d arguments\n", argname, count);                     \
-    exit(1);                                                                  \
-  }                                                                           \
-  if (strcmp(argv[offset + count], "-") == 0) {                               \
-    printf("%s requires %d arguments\n", argname, count);                     \
-    exit(1);                                                                  \
   }
 
 #define argbool(argname, argvalue)                                            \
@@ -75,3 +68,12 @@
     argbreak();                                                               \
     continue;                                                                 \
   }
+
+// collect a non-option argument ("-" alone counts as a value) into an Array
+#define argpositional(__array__)                                              \
+  if (argv[offset][0] != '-' || argv[offset][1] == '\0') {                    \
+    arrayPush((__array__), argv[offset]);                                     \
+    offset++;                                                                 \
+    argbreak();                                                               \
+    continue;                                                                 \
+  }
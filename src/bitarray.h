@@ -83,6 +83,26 @@ bitarraySet(BitArray* arr, size_t i, unsigned char value)
       ((value & arr->mask) << (i * arr->nbit) % 8);
 }
 
+// OR value into slot i with an atomic byte update, so several threads may fill
+// the same array. Bits are only ever added, never cleared.
+static inline void
+bitarraySetAtomic(BitArray* arr, size_t i, unsigned char value)
+{
+  if (arr == NULL) {
+    return;
+  }
+  if (i >= arr->size) {
+    printf("[Set] index out of bounds. size: %zu, i: %zu\n", arr->size, i);
+    return;
+  }
+  unsigned char* byte = &arr->data[(i * arr->nbit) / 8];
+  unsigned char bits = (value & arr->mask) << (i * arr->nbit) % 8;
+  if ((__atomic_load_n(byte, __ATOMIC_RELAXED) & bits) == bits) {
+    return;
+  }
+  __atomic_fetch_or(byte, bits, __ATOMIC_RELAXED);
+}
+
 static inline unsigned char
 bitarrayGet(BitArray* arr, size_t i)
 {
@@ -107,7 +127,7 @@ bitarrayOr(BitArray* arr, BitArray* other)
            other->size);
     return;
   }
-#ifdef parallel
+#ifdef ROA_PARALLEL
 #pragma omp parallel for
 #endif
   for (size_t i = 0; i < arr->__realCols; i++) {
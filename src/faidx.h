@@ -0,0 +1,308 @@
+#pragma once
+#include "alloc.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Record offsets of a plain FASTA file, in the samtools .fai layout: one
+// line per record with its name, length, byte offset of the first base,
+// bases per line and bytes per line. Every line of a record but the last
+// must be equally long, so base j of a record is found at
+//   offset + j / linebases * linewidth + j % linebases
+// and records can be fetched from the mapped file in any order, by any
+// thread.
+
+typedef struct {
+  char* name; // up to the first blank of the header
+  size_t length;
+  uint64_t offset;
+  size_t linebases;
+  size_t linewidth;
+} FaiRecord;
+
+typedef struct {
+  FaiRecord* records;
+  size_t size;
+  size_t capacity;
+  int fd;
+  const char* data; // the mapped FASTA, NULL when it is empty
+  size_t data_size;
+} Faidx;
+
+static inline void
+faiFree(Faidx* fai)
+{
+  if (fai == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < fai->size; i++) {
+    dfree(fai->records[i].name, strlen(fai->records[i].name) + 1);
+  }
+  if (fai->records) {
+    dfree(fai->records, sizeof(FaiRecord) * fai->capacity);
+  }
+  if (fai->data) {
+    munmap((void*)fai->data, fai->data_size);
+  }
+  if (fai->fd >= 0) {
+    close(fai->fd);
+  }
+  dfree(fai, sizeof(Faidx));
+}
+
+static inline FaiRecord*
+faiPush(Faidx* fai, const char* name, size_t len)
+{
+  if (fai->size == fai->capacity) {
+    size_t cap = roundup(fai->capacity + 1);
+    if (fai->records) {
+      fai->records = drealloc(fai->records, sizeof(FaiRecord) * fai->capacity,
+                              sizeof(FaiRecord) * cap);
+    } else {
+      fai->records = dmalloc(sizeof(FaiRecord) * cap);
+    }
+    fai->capacity = cap;
+  }
+  FaiRecord* record = fai->records + fai->size++;
+  record->name = dmalloc(len + 1);
+  memcpy(record->name, name, len);
+  record->name[len] = '\0';
+  record->length = 0;
+  record->offset = 0;
+  record->linebases = 0;
+  record->linewidth = 0;
+  return record;
+}
+
+// Scan the mapped file for records. Returns 0, with the reason logged, if
+// a record has lines of different lengths and so cannot be indexed.
+static inline int
+faiScan(Faidx* fai, const char* path)
+{
+  const char* data = fai->data;
+  size_t size = fai->data_size;
+  FaiRecord* record = NULL;
+  int last = 0; // the current record had its short last line
+  size_t pos = 0;
+  while (pos < size) {
+    const char* eol = memchr(data + pos, '\n', size - pos);
+    size_t end = eol ? (size_t)(eol - data) : size;
+    size_t next = eol ? end + 1 : size;
+    size_t bases = end - pos;
+    if (bases && data[end - 1] == '\r') {
+      bases--;
+    }
+    if (data[pos] == '>') {
+      // the name ends at a blank or the end of the line; the mapping has no
+      // NUL after a last line without a newline
+      const char* name = data + pos + 1;
+      size_t len = 0;
+      while (len < bases - 1 && name[len] != ' ' && name[len] != '\t'
+             && name[len] != '\r') {
+        len++;
+      }
+      record = faiPush(fai, name, len);
+      record->offset = next;
+      last = 0;
+    } else if (record == NULL) {
+      if (bases) {
+        warn("%s does not start with a FASTA header.", path);
+        return 0;
+      }
+    } else if (bases == 0) {
+      // blank lines may only end a record
+      last = 1;
+    } else {
+      if (last || (record->linebases && bases > record->linebases)) {
+        warn("record %s of %s has lines of different lengths.", record->name,
+             path);
+        return 0;
+      }
+      if (record->linebases == 0) {
+        record->linebases = bases;
+        record->linewidth = next - pos;
+      } else if (bases < record->linebases) {
+        last = 1;
+      }
+      record->length += bases;
+    }
+    pos = next;
+  }
+  return 1;
+}
+
+static inline int
+faiLoad(Faidx* fai, const char* path)
+{
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) {
+    return 0;
+  }
+  char line[4096];
+  int ok = 1;
+  while (ok && fgets(line, sizeof(line), fp)) {
+    char* tab = strchr(line, '\t');
+    if (tab == NULL) {
+      ok = 0;
+      break;
+    }
+    FaiRecord* record = faiPush(fai, line, tab - line);
+    char* p = tab + 1;
+    record->length = strtoull(p, &p, 10);
+    record->offset = strtoull(p, &p, 10);
+    record->linebases = strtoull(p, &p, 10);
+    record->linewidth = strtoull(p, &p, 10);
+    ok = record->offset <= fai->data_size
+         && (record->length == 0 || record->linebases);
+  }
+  fclose(fp);
+  if (!ok) {
+    warn("ignore broken index %s.", path);
+    for (size_t i = 0; i < fai->size; i++) {
+      dfree(fai->records[i].name, strlen(fai->records[i].name) + 1);
+    }
+    fai->size = 0;
+  }
+  return ok;
+}
+
+static inline int
+faiSave(Faidx* fai, const char* path)
+{
+  FILE* fp = fopen(path, "w");
+  if (fp == NULL) {
+    error("write %s failed. %s", path, strerror(errno));
+    return 0;
+  }
+  for (size_t i = 0; i < fai->size; i++) {
+    FaiRecord* r = fai->records + i;
+    fprintf(fp, "%s\t%zu\t%llu\t%zu\t%zu\n", r->name, r->length,
+            (unsigned long long)r->offset, r->linebases, r->linewidth);
+  }
+  return fclose(fp) == 0;
+}
+
+static inline char*
+faiPath(const char* path)
+{
+  size_t len = strlen(path);
+  char* fai_path = dmalloc(len + 5);
+  memcpy(fai_path, path, len);
+  memcpy(fai_path + len, ".fai", 5);
+  return fai_path;
+}
+
+// Map a plain FASTA file and index it, reusing <path>.fai when it is at
+// least as new as the file. Returns NULL, after a warning, for inputs that
+// cannot be indexed; they have to be parsed sequentially instead.
+static inline Faidx*
+faiOpen(const char* path)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  Faidx* fai = dmalloc(sizeof(Faidx));
+  fai->records = NULL;
+  fai->size = 0;
+  fai->capacity = 0;
+  fai->fd = fd;
+  fai->data = NULL;
+  fai->data_size = st.st_size;
+  if (st.st_size > 0) {
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      warn("map %s failed. %s", path, strerror(errno));
+      faiFree(fai);
+      return NULL;
+    }
+    fai->data = data;
+  }
+  if (fai->data_size >= 2 && (unsigned char)fai->data[0] == 0x1f
+      && (unsigned char)fai->data[1] == 0x8b) {
+    faiFree(fai);
+    return NULL;
+  }
+  char* fai_path = faiPath(path);
+  struct stat fst;
+  int fresh = stat(fai_path, &fst) == 0 && fst.st_mtime >= st.st_mtime;
+  if (!fresh || !faiLoad(fai, fai_path)) {
+    if (!faiScan(fai, path)) {
+      faiFree(fai);
+      fai = NULL;
+    }
+  }
+  dfree(fai_path, strlen(path) + 5);
+  return fai;
+}
+
+// index of the record called name, -1 if there is none
+static inline long
+faiFind(Faidx* fai, const char* name, size_t len)
+{
+  for (size_t i = 0; i < fai->size; i++) {
+    if (strlen(fai->records[i].name) == len
+        && strncmp(fai->records[i].name, name, len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// The full header line of record i without '>' and the line end, as a view
+// into the mapping: it is the line right before the first base.
+static inline const char*
+faiHeader(Faidx* fai, size_t i, size_t* len)
+{
+  FaiRecord* record = fai->records + i;
+  size_t end = record->offset;
+  if (end && fai->data[end - 1] == '\n') {
+    end--;
+  }
+  if (end && fai->data[end - 1] == '\r') {
+    end--;
+  }
+  size_t start = end;
+  while (start && fai->data[start - 1] != '\n') {
+    start--;
+  }
+  if (start < end && fai->data[start] == '>') {
+    start++;
+  }
+  *len = end - start;
+  return fai->data + start;
+}
+
+// copy bases [start, end) of record i into out; returns the number copied
+static inline size_t
+faiFetch(Faidx* fai, size_t i, size_t start, size_t end, char* out)
+{
+  FaiRecord* record = fai->records + i;
+  end = end < record->length ? end : record->length;
+  size_t n = 0;
+  while (start + n < end) {
+    size_t j = start + n;
+    size_t col = j % record->linebases;
+    size_t run = record->linebases - col;
+    run = run < end - j ? run : end - j;
+    uint64_t at = record->offset + j / record->linebases * record->linewidth
+                  + col;
+    if (at + run > fai->data_size) {
+      break;
+    }
+    memcpy(out + n, fai->data + at, run);
+    n += run;
+  }
+  return n;
+}
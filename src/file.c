@@ -11,19 +11,165 @@ xfile(const char* path, const char* mode)
   file->length = 0;
   file->offset = 0;
   file->buff_offset = 0;
-  file->buff_size = FILE_BUFF_SIZE;
+  file->buff_size = 0;
   file->no_more_data = 0;
   file->line = NULL;
   file->open = 0;
-  memset(file->buff, 0, sizeof(char) * FILE_BUFF_SIZE);
+  file->buff = NULL;
+  file->store = NULL;
+  file->ahead = NULL;
   return file;
 }
 
+// producer side of the read-ahead ring: fill free slots until the input ends
+// or the consumer asks to stop
+static void*
+xfile_ahead_run(void* arg)
+{
+  XFileAhead* ahead = arg;
+  // whatever inflating needs is I/O, not the stage the consumer is in
+  memSetThreadTag(MEM_TAG_IO);
+  while (1) {
+    pthread_mutex_lock(&ahead->lock);
+    while (ahead->filled - ahead->released >= FILE_AHEAD_SLOTS
+           && !ahead->stop) {
+      pthread_cond_wait(&ahead->freed, &ahead->lock);
+    }
+    int stop = ahead->stop;
+    size_t slot = ahead->filled % FILE_AHEAD_SLOTS;
+    pthread_mutex_unlock(&ahead->lock);
+    if (stop) {
+      break;
+    }
+    size_t size = ahead->read(ahead->file, FILE_AHEAD_SIZE, ahead->data[slot]);
+    pthread_mutex_lock(&ahead->lock);
+    ahead->size[slot] = size;
+    ahead->filled++;
+    if (size < FILE_AHEAD_SIZE) {
+      ahead->done = 1;
+    }
+    int done = ahead->done;
+    pthread_cond_signal(&ahead->ready);
+    pthread_mutex_unlock(&ahead->lock);
+    if (done) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Hand reading over to a producer thread. Only allowed before the first
+// block was loaded; returns 0 if the file keeps reading inline.
+int
+xfile_readahead(XFile* file, read_t read)
+{
+  if (FP(file) == NULL || file->ahead || file->buff_size
+      || file->no_more_data) {
+    return 0;
+  }
+  XFileAhead* ahead = dmalloc(sizeof(XFileAhead));
+  ahead->file = file;
+  ahead->read = read;
+  ahead->filled = 0;
+  ahead->taken = 0;
+  ahead->released = 0;
+  ahead->done = 0;
+  ahead->stop = 0;
+  for (int i = 0; i < FILE_AHEAD_SLOTS; i++) {
+    ahead->data[i] = dmallocTag(FILE_AHEAD_SIZE, MEM_TAG_IO);
+    ahead->size[i] = 0;
+  }
+  pthread_mutex_init(&ahead->lock, NULL);
+  pthread_cond_init(&ahead->ready, NULL);
+  pthread_cond_init(&ahead->freed, NULL);
+  file->ahead = ahead;
+  if (pthread_create(&ahead->thread, NULL, xfile_ahead_run, ahead) != 0) {
+    file->ahead = NULL;
+    for (int i = 0; i < FILE_AHEAD_SLOTS; i++) {
+      dfreeTag(ahead->data[i], FILE_AHEAD_SIZE, MEM_TAG_IO);
+    }
+    dfree(ahead, sizeof(XFileAhead));
+    return 0;
+  }
+  return 1;
+}
+
+// join the producer and drop whatever it buffered; the file is left with
+// an empty buffer, ready for a seek
+void
+xfile_stop_ahead(XFile* file)
+{
+  XFileAhead* ahead = file->ahead;
+  if (ahead == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&ahead->lock);
+  ahead->stop = 1;
+  pthread_cond_signal(&ahead->freed);
+  pthread_mutex_unlock(&ahead->lock);
+  pthread_join(ahead->thread, NULL);
+  pthread_mutex_destroy(&ahead->lock);
+  pthread_cond_destroy(&ahead->ready);
+  pthread_cond_destroy(&ahead->freed);
+  for (int i = 0; i < FILE_AHEAD_SLOTS; i++) {
+    dfreeTag(ahead->data[i], FILE_AHEAD_SIZE, MEM_TAG_IO);
+  }
+  dfree(ahead, sizeof(XFileAhead));
+  file->ahead = NULL;
+  file->buff = NULL;
+  file->buff_size = 0;
+  file->buff_offset = 0;
+}
+
+// load the next block into file->buff, from the read-ahead ring if there is
+// one; returns its size, 0 at the end of input
+size_t
+xfile_fill(XFile* file, read_t read)
+{
+  size_t size = 0;
+  if (file->no_more_data) {
+    size = 0;
+  } else if (file->ahead) {
+    XFileAhead* ahead = file->ahead;
+    pthread_mutex_lock(&ahead->lock);
+    // the block parsed so far goes back to the producer
+    ahead->released = ahead->taken;
+    pthread_cond_signal(&ahead->freed);
+    while (ahead->taken == ahead->filled) {
+      pthread_cond_wait(&ahead->ready, &ahead->lock);
+    }
+    size_t slot = ahead->taken++ % FILE_AHEAD_SLOTS;
+    size = ahead->size[slot];
+    pthread_mutex_unlock(&ahead->lock);
+    file->buff = ahead->data[slot];
+    if (size < FILE_AHEAD_SIZE) {
+      file->no_more_data = 1;
+    }
+  } else {
+    if (file->store == NULL) {
+      file->store = dmallocTag(FILE_BUFF_SIZE, MEM_TAG_IO);
+    }
+    file->buff = file->store;
+    size = read(file, FILE_BUFF_SIZE, file->buff);
+    if (size < FILE_BUFF_SIZE) {
+      file->no_more_data = 1;
+    }
+  }
+  file->offset += size;
+  file->buff_size = size;
+  file->buff_offset = 0;
+  return size;
+}
+
 void
 destory_xfile(XFile* file)
 {
-  file->open = 0;
   if (file) {
+    file->open = 0;
+    xfile_stop_ahead(file);
+    if (file->store) {
+      dfreeTag(file->store, FILE_BUFF_SIZE, MEM_TAG_IO);
+    }
     dfree(file, sizeof(XFile));
   }
 }
@@ -35,6 +181,7 @@ plain_seek(XFile* file, long int offset, int whence)
   if (fp == NULL) {
     return 0;
   }
+  xfile_stop_ahead(file);
   fseek(fp, offset, whence);
   return 1;
 }
@@ -42,9 +189,10 @@ plain_seek(XFile* file, long int offset, int whence)
 static inline int
 plain_reset(XFile* file)
 {
+  xfile_stop_ahead(file);
   file->buff_offset = 0;
   file->no_more_data = 0;
-  file->buff_size = FILE_BUFF_SIZE;
+  file->buff_size = 0;
   file->offset = 0;
   return plain_seek(file, 0, SEEK_SET);
 }
@@ -72,7 +220,7 @@ plain_open(const char* path, const char* mode)
   file->length = plain_length(file);
   file->offset = 0;
   file->buff_offset = 0;
-  file->buff_size = FILE_BUFF_SIZE;
+  file->buff_size = 0;
   return file;
 }
 
@@ -96,21 +244,42 @@ plain_write(XFile* file, size_t size, char* buff)
   return fwrite(buff, sizeof(char), size, fp);
 }
 
+typedef size_t (*write_t)(XFile* file, size_t size, char* buff);
+
+// format into a stack buffer, or a heap one for long output, and write it
+static inline size_t
+xfile_vwrite_format(XFile* file, write_t write, const char* format,
+                    va_list args)
+{
+  char stack[1024];
+  va_list copy;
+  va_copy(copy, args);
+  int n = vsnprintf(stack, sizeof(stack), format, copy);
+  va_end(copy);
+  if (n < 0) {
+    return 0;
+  }
+  if ((size_t)n < sizeof(stack)) {
+    return write(file, n, stack);
+  }
+  char* heap = dmalloc(n + 1);
+  vsnprintf(heap, n + 1, format, args);
+  size_t size = write(file, n, heap);
+  dfree(heap, n + 1);
+  return size;
+}
+
 size_t
 plain_write_format(XFile* file, char* format, ...)
 {
-  void* fp = FP(file);
-  if (fp == NULL) {
+  if (FP(file) == NULL) {
     return 0;
   }
-
-  // TODO
-  char buff[1024] = { 0 };
   va_list valist;
   va_start(valist, format);
-  vsnprintf(buff, sizeof(buff), format, valist);
+  size_t size = xfile_vwrite_format(file, plain_write, format, valist);
   va_end(valist);
-  return plain_write(fp, strlen(buff), buff);
+  return size;
 }
 
 int
@@ -120,14 +289,20 @@ plain_close(XFile* file)
   if (fp == NULL) {
     return 0;
   }
+  xfile_stop_ahead(file);
   fclose(fp);
   destory_xfile(file);
   return 1;
 }
 
-typedef size_t (*read_t)(XFile* file, size_t size, char* buff);
+typedef size_t (*fill_t)(XFile* file);
+// Return the next line without its LF or CRLF. Line ends are found with
+// memchr, and a line that lies inside the read buffer is returned as a view
+// into it: line->line is not NUL terminated and stays valid until the next
+// call. Only a line that straddles a refill is gathered in the line's own
+// storage.
 static __always_inline line_t*
-readline(XFile* file, line_t* line, read_t read_func)
+readline(XFile* file, line_t* line, fill_t fill)
 {
   void* fp = FP(file);
 
@@ -139,116 +314,96 @@ readline(XFile* file, line_t* line, read_t read_func)
     line = dmalloc(sizeof(line_t));
     line->line = NULL;
     line->size = 0;
+    line->store = NULL;
     line->capacity = 0;
   }
 
-  char c;
-  char* s = NULL;
-
-  if (file->no_more_data && file->buff_offset >= file->buff_size) {
-    line->size = 0;
-    goto clean;
-  }
-
-  size_t s_len = 0;
-  size_t s_cap = 0;
-  if (line->line == NULL) {
-    s = line->line = dmalloc(MIN_BUFF_SIZE * sizeof(char) + 1);
-    line->capacity = MIN_BUFF_SIZE;
-    memset(s, 0, MIN_BUFF_SIZE * sizeof(char) + 1);
-  } else {
-    s = line->line;
-    if (s) {
-      memset(s, 0, strlen(s));
-    }
-  }
-  s_cap = line->capacity;
+  size_t spill = 0;
   while (1) {
-
-    if (file->no_more_data && file->buff_offset >= file->buff_size) {
-      if (s_len) {
-        goto success;
-      }
-      goto clean;
-    }
-
     if (file->buff_offset >= file->buff_size) {
-      file->buff_offset = 0;
-    }
-
-    int i = file->buff_offset;
-
-    size_t read_size = 0;
-    if (!i && !file->no_more_data) {
-      read_size = read_func(file, FILE_BUFF_SIZE, file->buff);
-      file->offset += read_size;
-      if (read_size < FILE_BUFF_SIZE) {
-        file->no_more_data = 1;
-      }
-      file->buff_size = read_size;
-    }
-
-    for (; i < file->buff_size; i++) {
-      c = file->buff[i];
-      if (c == LF) {
-        // LF
-        file->buff_offset++;
-        goto success;
-      } else if (c == CR) {
-        if (file->buff[i + 1] == LF) {
-          // CR LF
-          file->buff_offset += 2;
-        } else {
-          // CR
-          file->buff_offset++;
+      if (file->no_more_data) {
+        if (spill) {
+          line->line = line->store;
+          line->size = spill;
+          break;
         }
-        goto success;
+        goto clean;
       }
-      s[s_len++] = c;
-      file->buff_offset++;
-      if (s_len == s_cap - 1) {
-        size_t old_cap = s_cap;
-        s_cap += s_cap / 5;
-        line->line = s =
-            drealloc(s, old_cap * sizeof(char) + 1, s_cap * sizeof(char) + 1);
-        line->capacity = s_cap;
+      fill(file);
+      continue;
+    }
+    char* start = file->buff + file->buff_offset;
+    size_t avail = file->buff_size - file->buff_offset;
+    char* end = memchr(start, LF, avail);
+    size_t len = end ? (size_t)(end - start) : avail;
+    file->buff_offset += end ? len + 1 : len;
+    if (end && spill == 0) {
+      line->line = start;
+      line->size = len;
+      break;
+    }
+    if (spill + len > line->capacity) {
+      size_t cap = roundup(spill + len);
+      cap = cap < MIN_BUFF_SIZE ? MIN_BUFF_SIZE : cap;
+      if (line->store) {
+        line->store = drealloc(line->store, line->capacity, cap);
+      } else {
+        line->store = dmalloc(cap);
       }
+      line->capacity = cap;
     }
+    memcpy(line->store + spill, start, len);
+    spill += len;
+    if (end) {
+      line->line = line->store;
+      line->size = spill;
+      break;
+    }
+  }
+  if (line->size && line->line[line->size - 1] == CR) {
+    line->size--;
   }
+  file->line = line;
+  return line;
 
 clean:
   if (line) {
-    if (line->line) {
-      dfree(line->line, line->capacity + 1);
+    if (line->store) {
+      dfree(line->store, line->capacity);
     }
     dfree(line, sizeof(line_t));
   }
   file->line = NULL;
   return NULL;
-
-success:
-  line->size = s_len;
-  line->line[s_len] = '\0';
-  file->line = line;
-  return line;
 }
 
+size_t plain_fill(XFile* file);
+
 line_t*
 plain_readline(XFile* file, line_t* line)
 {
-  return readline(file, line, plain_read);
+  return readline(file, line, plain_fill);
+}
+
+size_t
+plain_fill(XFile* file)
+{
+  return xfile_fill(file, plain_read);
+}
+
+int
+plain_readahead(XFile* file)
+{
+  return xfile_readahead(file, plain_read);
 }
 
 size_t
 plain_count(XFile* file, char c)
 {
   size_t count = 0;
-  while (!file->no_more_data) {
-    size_t read_size = plain_read(file, FILE_BUFF_SIZE, file->buff);
-    if (read_size < FILE_BUFF_SIZE) {
-      file->no_more_data = 1;
-    }
-    for (int i = 0; i < read_size; i++) {
+  size_t read_size = 0;
+  while ((read_size = plain_fill(file)) > 0) {
+    for (size_t i = 0; i < read_size; i++) {
       if (file->buff[i] == c) {
         count++;
       }
@@ -265,6 +420,7 @@ zip_close(XFile* file)
   if (fp == NULL) {
     return 0;
   }
+  xfile_stop_ahead(file);
   gzclose(fp);
   destory_xfile(file);
   return 1;
@@ -319,7 +475,7 @@ zip_open(const char* path, const char* mode)
   file->length = zip_length(file);
   file->offset = 0;
   file->buff_offset = 0;
-  file->buff_size = FILE_BUFF_SIZE;
+  file->buff_size = 0;
   return file;
 }
 
@@ -330,6 +486,7 @@ zip_seek(XFile* file, long int offset, int whence)
   if (fp == NULL) {
     return 0;
   }
+  xfile_stop_ahead(file);
   gzseek(fp, offset, whence);
   return 1;
 }
@@ -337,9 +494,10 @@ zip_seek(XFile* file, long int offset, int whence)
 static inline int
 zip_reset(XFile* file)
 {
+  xfile_stop_ahead(file);
   file->buff_offset = 0;
   file->no_more_data = 0;
-  file->buff_size = FILE_BUFF_SIZE;
+  file->buff_size = 0;
   file->offset = 0;
   return zip_seek(file, 0, SEEK_SET);
 }
@@ -367,35 +525,43 @@ zip_write(XFile* file, size_t size, char* buff)
 size_t
 zip_write_format(XFile* file, char* format, ...)
 {
-  void* fp = FP(file);
-  if (fp == NULL) {
+  if (FP(file) == NULL) {
     return 0;
   }
-
-  char buff[1024] = { 0 };
   va_list valist;
   va_start(valist, format);
-  vsnprintf(buff, sizeof(buff), format, valist);
+  size_t size = xfile_vwrite_format(file, zip_write, format, valist);
   va_end(valist);
-  return zip_write(fp, strlen(buff), buff);
+  return size;
 }
 
+size_t zip_fill(XFile* file);
+
 line_t*
 zip_readline(XFile* file, line_t* line)
 {
-  return readline(file, line, zip_read);
+  return readline(file, line, zip_fill);
+}
+
+size_t
+zip_fill(XFile* file)
+{
+  return xfile_fill(file, zip_read);
+}
+
+int
+zip_readahead(XFile* file)
+{
+  return xfile_readahead(file, zip_read);
 }
 
 size_t
 zip_count(XFile* file, char c)
 {
   size_t count = 0;
-  while (!file->no_more_data) {
-    size_t read_size = zip_read(file, FILE_BUFF_SIZE, file->buff);
-    if (read_size < FILE_BUFF_SIZE) {
-      file->no_more_data = 1;
-    }
-    for (int i = 0; i < read_size; i++) {
+  size_t read_size = 0;
+  while ((read_size = zip_fill(file)) > 0) {
+    for (size_t i = 0; i < read_size; i++) {
       if (file->buff[i] == c) {
         count++;
       }
@@ -405,6 +571,490 @@ zip_count(XFile* file, char c)
   return count;
 }
 
+// BGZF: a series of gzip members of at most 64KB of input each, whose size
+// is kept in a "BC" extra subfield. Reads parse the block headers up front,
+// place every block at its known output offset and inflate the blocks in
+// parallel.
+
+#define BGZF_HEADER_SIZE 18
+#define BGZF_MAX_BLOCK_SIZE 65536
+#define BGZF_BUFF_SIZE (1024 * 1024 * 16)
+
+typedef struct {
+  FILE* fp;
+  unsigned char* in; // compressed bytes read from fp
+  size_t in_start;
+  size_t in_end;
+  int in_eof;
+  char carry[BGZF_MAX_BLOCK_SIZE]; // inflated block that did not fit a read
+  size_t carry_start;
+  size_t carry_end;
+} Bgzf;
+
+typedef struct {
+  const unsigned char* src; // deflate data
+  size_t src_size;
+  char* dst;
+  uint32_t isize;
+  uint32_t crc;
+} BgzfBlock;
+
+// size of the BGZF block starting at p, 0 if p holds no BGZF header
+static inline size_t
+bgzf_block_size(const unsigned char* p, size_t n)
+{
+  if (n < 12 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4)) {
+    return 0;
+  }
+  size_t xlen = p[10] | (p[11] << 8);
+  if (n < 12 + xlen) {
+    return 0;
+  }
+  for (size_t x = 12; x + 4 <= 12 + xlen;) {
+    size_t slen = p[x + 2] | (p[x + 3] << 8);
+    if (p[x] == 'B' && p[x + 1] == 'C' && slen == 2 && x + 6 <= 12 + xlen) {
+      return (size_t)(p[x + 4] | (p[x + 5] << 8)) + 1;
+    }
+    x += 4 + slen;
+  }
+  return 0;
+}
+
+// make sure at least need compressed bytes are buffered, if the file has them
+static inline void
+bgzf_fill_in(Bgzf* bgzf, size_t need)
+{
+  if (bgzf->in_end - bgzf->in_start >= need || bgzf->in_eof) {
+    return;
+  }
+  memmove(bgzf->in, bgzf->in + bgzf->in_start, bgzf->in_end - bgzf->in_start);
+  bgzf->in_end -= bgzf->in_start;
+  bgzf->in_start = 0;
+  while (bgzf->in_end < BGZF_BUFF_SIZE && !bgzf->in_eof) {
+    size_t n = fread(bgzf->in + bgzf->in_end, 1, BGZF_BUFF_SIZE - bgzf->in_end,
+                     bgzf->fp);
+    if (n == 0) {
+      bgzf->in_eof = 1;
+    }
+    bgzf->in_end += n;
+  }
+}
+
+static inline int
+bgzf_inflate(BgzfBlock* block)
+{
+  z_stream strm;
+  memset(&strm, 0, sizeof(z_stream));
+  if (inflateInit2(&strm, -15) != Z_OK) {
+    return 0;
+  }
+  strm.next_in = (Bytef*)block->src;
+  strm.avail_in = block->src_size;
+  strm.next_out = (Bytef*)block->dst;
+  strm.avail_out = block->isize;
+  int ret = inflate(&strm, Z_FINISH);
+  inflateEnd(&strm);
+  return ret == Z_STREAM_END && strm.total_out == block->isize
+         && crc32(0L, (const Bytef*)block->dst, block->isize) == block->crc;
+}
+
+XFile*
+bgzf_open(const char* path, const char* mode)
+{
+  FILE* fp;
+  if ((fp = fopen(path, mode)) == NULL) {
+    fprintf(stderr, "Open file: %s failed. %s\n", path, display_error);
+    return NULL;
+  }
+  Bgzf* bgzf = dmalloc(sizeof(Bgzf));
+  bgzf->fp = fp;
+  bgzf->in = dmallocTag(BGZF_BUFF_SIZE, MEM_TAG_IO);
+  bgzf->in_start = bgzf->in_end = 0;
+  bgzf->in_eof = 0;
+  bgzf->carry_start = bgzf->carry_end = 0;
+  XFile* file = xfile(path, mode);
+  file->fp = bgzf;
+  file->open = 1;
+  return file;
+}
+
+// inflate up to size bytes into buff; short only at the end of input
+size_t
+bgzf_read(XFile* file, size_t size, char* buff)
+{
+  Bgzf* bgzf = FP(file);
+  if (bgzf == NULL) {
+    return 0;
+  }
+  size_t out = bgzf->carry_end - bgzf->carry_start;
+  out = out < size ? out : size;
+  memcpy(buff, bgzf->carry + bgzf->carry_start, out);
+  bgzf->carry_start += out;
+  // full sized blocks fill a read in one batch, smaller ones take several
+  size_t cap = size / BGZF_MAX_BLOCK_SIZE + 2;
+  BgzfBlock* blocks = dmalloc(sizeof(BgzfBlock) * cap);
+  while (out < size) {
+    // lay out the blocks that are buffered and fit, plus one for the carry
+    size_t n = 0;
+    size_t placed = out;
+    int carried = 0;
+    while (placed < size && !carried && n < cap) {
+      if (n && bgzf->in_end - bgzf->in_start < BGZF_HEADER_SIZE) {
+        // refilling moves the buffer under the blocks laid out so far
+        break;
+      }
+      bgzf_fill_in(bgzf, BGZF_HEADER_SIZE);
+      const unsigned char* p = bgzf->in + bgzf->in_start;
+      size_t avail = bgzf->in_end - bgzf->in_start;
+      if (avail == 0) {
+        break;
+      }
+      size_t bsize = bgzf_block_size(p, avail);
+      if (bsize < BGZF_HEADER_SIZE + 8 || bsize > BGZF_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Read file: %s failed. Broken BGZF block.\n",
+                file->path);
+        exit(1);
+      }
+      if (avail < bsize) {
+        if (n) {
+          break;
+        }
+        bgzf_fill_in(bgzf, bsize);
+        p = bgzf->in + bgzf->in_start;
+        avail = bgzf->in_end - bgzf->in_start;
+        if (avail < bsize) {
+          fprintf(stderr, "Read file: %s failed. Truncated BGZF block.\n",
+                  file->path);
+          exit(1);
+        }
+      }
+      size_t xlen = p[10] | (p[11] << 8);
+      BgzfBlock* block = &blocks[n++];
+      block->src = p + 12 + xlen;
+      block->src_size = bsize - 12 - xlen - 8;
+      block->crc = p[bsize - 8] | (p[bsize - 7] << 8) | (p[bsize - 6] << 16)
+                   | ((uint32_t)p[bsize - 5] << 24);
+      block->isize = p[bsize - 4] | (p[bsize - 3] << 8) | (p[bsize - 2] << 16)
+                     | ((uint32_t)p[bsize - 1] << 24);
+      if (block->isize > BGZF_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Read file: %s failed. Broken BGZF block.\n",
+                file->path);
+        exit(1);
+      }
+      if (placed + block->isize <= size) {
+        block->dst = buff + placed;
+        placed += block->isize;
+      } else {
+        block->dst = bgzf->carry;
+        carried = 1;
+      }
+      bgzf->in_start += bsize;
+    }
+    if (n == 0) {
+      break;
+    }
+    int failed = 0;
+#ifdef ROA_PARALLEL
+#pragma omp parallel for schedule(dynamic, 4) reduction(| : failed)
+#endif
+    for (size_t i = 0; i < n; i++) {
+      failed |= !bgzf_inflate(&blocks[i]);
+    }
+    if (failed) {
+      fprintf(stderr, "Read file: %s failed. Corrupted BGZF data.\n",
+              file->path);
+      exit(1);
+    }
+    out = placed;
+    if (carried) {
+      size_t take = size - out;
+      memcpy(buff + out, bgzf->carry, take);
+      out += take;
+      bgzf->carry_start = take;
+      bgzf->carry_end = blocks[n - 1].isize;
+    }
+  }
+  dfree(blocks, sizeof(BgzfBlock) * cap);
+  return out;
+}
+
+static inline int
+bgzf_reset(XFile* file)
+{
+  Bgzf* bgzf = FP(file);
+  if (bgzf == NULL) {
+    return 0;
+  }
+  xfile_stop_ahead(file);
+  file->buff_offset = 0;
+  file->no_more_data = 0;
+  file->buff_size = 0;
+  file->offset = 0;
+  bgzf->in_start = bgzf->in_end = 0;
+  bgzf->in_eof = 0;
+  bgzf->carry_start = bgzf->carry_end = 0;
+  fseek(bgzf->fp, 0, SEEK_SET);
+  return 1;
+}
+
+// only rewinding is supported: BGZF offsets are virtual
+int
+bgzf_seek(XFile* file, long int offset, int whence)
+{
+  if (offset != 0 || whence != SEEK_SET) {
+    return 0;
+  }
+  return bgzf_reset(file);
+}
+
+int
+bgzf_close(XFile* file)
+{
+  Bgzf* bgzf = FP(file);
+  if (bgzf == NULL) {
+    return 0;
+  }
+  xfile_stop_ahead(file);
+  fclose(bgzf->fp);
+  dfreeTag(bgzf->in, BGZF_BUFF_SIZE, MEM_TAG_IO);
+  dfree(bgzf, sizeof(Bgzf));
+  destory_xfile(file);
+  return 1;
+}
+
+static inline size_t
+bgzf_length(XFile* file)
+{
+  return 0;
+}
+
+// BGZF inputs are read only; output goes through XWriter
+size_t
+bgzf_write(XFile* file, size_t size, char* buff)
+{
+  error("write %s failed. BGZF files are opened for reading only.",
+        file->path);
+  exit(1);
+}
+
+size_t
+bgzf_write_format(XFile* file, char* format, ...)
+{
+  return bgzf_write(file, 0, NULL);
+}
+
+size_t
+bgzf_fill(XFile* file)
+{
+  return xfile_fill(file, bgzf_read);
+}
+
+int
+bgzf_readahead(XFile* file)
+{
+  return xfile_readahead(file, bgzf_read);
+}
+
+line_t*
+bgzf_readline(XFile* file, line_t* line)
+{
+  return readline(file, line, bgzf_fill);
+}
+
+size_t
+bgzf_count(XFile* file, char c)
+{
+  size_t count = 0;
+  size_t read_size = 0;
+  while ((read_size = bgzf_fill(file)) > 0) {
+    for (size_t i = 0; i < read_size; i++) {
+      if (file->buff[i] == c) {
+        count++;
+      }
+    }
+  }
+  bgzf_reset(file);
+  return count;
+}
+
+// mmap: regular files are mapped read only and parsed in place. fill hands
+// out the whole rest of the mapping at once, so no byte is copied and a
+// line never straddles a refill; the kernel reads ahead on its own.
+
+typedef struct {
+  int fd;
+  char* data; // NULL for an empty file
+  size_t size;
+  size_t pos; // next byte to hand out
+} MmapFile;
+
+XFile*
+mmap_open(const char* path, const char* mode)
+{
+  if (strchr(mode, 'w') || strchr(mode, 'a') || strchr(mode, '+')) {
+    fprintf(stderr, "Open file: %s failed. mmap files are read only.\n",
+            path);
+    return NULL;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Open file: %s failed. %s\n", path, display_error);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "Open file: %s failed. %s\n", path, display_error);
+    close(fd);
+    return NULL;
+  }
+  char* data = NULL;
+  if (st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Map file: %s failed. %s\n", path, display_error);
+      close(fd);
+      return NULL;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+  }
+  MmapFile* map = dmalloc(sizeof(MmapFile));
+  map->fd = fd;
+  map->data = data;
+  map->size = st.st_size;
+  map->pos = 0;
+  XFile* file = xfile(path, mode);
+  file->fp = map;
+  file->open = 1;
+  file->length = map->size;
+  return file;
+}
+
+size_t
+mmap_read(XFile* file, size_t size, char* buff)
+{
+  MmapFile* map = FP(file);
+  if (map == NULL) {
+    return 0;
+  }
+  size_t left = map->size - map->pos;
+  size = size < left ? size : left;
+  memcpy(buff, map->data + map->pos, size);
+  map->pos += size;
+  return size;
+}
+
+int
+mmap_seek(XFile* file, long int offset, int whence)
+{
+  MmapFile* map = FP(file);
+  if (map == NULL) {
+    return 0;
+  }
+  long int base = whence == SEEK_SET   ? 0
+                  : whence == SEEK_CUR ? (long int)map->pos
+                                       : (long int)map->size;
+  if (base + offset < 0 || (size_t)(base + offset) > map->size) {
+    return 0;
+  }
+  map->pos = base + offset;
+  return 1;
+}
+
+static inline int
+mmap_reset(XFile* file)
+{
+  file->buff = NULL;
+  file->buff_offset = 0;
+  file->no_more_data = 0;
+  file->buff_size = 0;
+  file->offset = 0;
+  return mmap_seek(file, 0, SEEK_SET);
+}
+
+int
+mmap_close(XFile* file)
+{
+  MmapFile* map = FP(file);
+  if (map == NULL) {
+    return 0;
+  }
+  if (map->data) {
+    munmap(map->data, map->size);
+  }
+  close(map->fd);
+  dfree(map, sizeof(MmapFile));
+  destory_xfile(file);
+  return 1;
+}
+
+size_t
+mmap_length(XFile* file)
+{
+  MmapFile* map = FP(file);
+  return map ? map->size : 0;
+}
+
+// mapped inputs are read only; output goes through XWriter
+size_t
+mmap_write(XFile* file, size_t size, char* buff)
+{
+  error("write %s failed. Mapped files are opened for reading only.",
+        file->path);
+  exit(1);
+}
+
+size_t
+mmap_write_format(XFile* file, char* format, ...)
+{
+  return mmap_write(file, 0, NULL);
+}
+
+// point buff at the rest of the mapping
+size_t
+mmap_fill(XFile* file)
+{
+  MmapFile* map = FP(file);
+  size_t size = 0;
+  if (map && !file->no_more_data) {
+    file->buff = map->data + map->pos;
+    size = map->size - map->pos;
+    map->pos = map->size;
+  }
+  file->no_more_data = 1;
+  file->offset += size;
+  file->buff_size = size;
+  file->buff_offset = 0;
+  return size;
+}
+
+// the page cache already reads ahead of a sequential mapping
+int
+mmap_readahead(XFile* file)
+{
+  return 0;
+}
+
+line_t*
+mmap_readline(XFile* file, line_t* line)
+{
+  return readline(file, line, mmap_fill);
+}
+
+size_t
+mmap_count(XFile* file, char c)
+{
+  size_t count = 0;
+  size_t size = mmap_fill(file);
+  const char* p = file->buff;
+  const char* end = p + size;
+  while (p < end && (p = memchr(p, c, end - p)) != NULL) {
+    count++;
+    p++;
+  }
+  mmap_reset(file);
+  return count;
+}
+
 XFileHandle plainFile = {
   .close = plain_close,
   .open = plain_open,
@@ -416,8 +1066,30 @@ XFileHandle plainFile = {
   .length = plain_length,
   .count = plain_count,
   .reset = plain_reset,
+  .fill = plain_fill,
+  .readahead = plain_readahead,
 };
 
+// gzip or plain text from stdin ("-") or a pipe, sniffed by zlib in-stream
+XFile*
+stream_open(const char* path, const char* mode)
+{
+  int fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+  gzFile fp = fd < 0 ? NULL : gzdopen(fd, mode);
+  if (fp == NULL) {
+    fprintf(stderr, "Open file: %s failed. %s\n", path, display_error);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  gzbuffer(fp, 1024 * 1024);
+  XFile* file = xfile(path, mode);
+  file->fp = fp;
+  file->open = 1;
+  return file;
+}
+
 XFileHandle zipFile = {
   .close = zip_close,
   .open = zip_open,
@@ -429,4 +1101,305 @@ XFileHandle zipFile = {
   .length = zip_length,
   .count = zip_count,
   .reset = zip_reset,
+  .fill = zip_fill,
+  .readahead = zip_readahead,
+};
+
+XFileHandle bgzfFile = {
+  .close = bgzf_close,
+  .open = bgzf_open,
+  .read = bgzf_read,
+  .seek = bgzf_seek,
+  .write = bgzf_write,
+  .write_format = bgzf_write_format,
+  .readline = bgzf_readline,
+  .length = bgzf_length,
+  .count = bgzf_count,
+  .reset = bgzf_reset,
+  .fill = bgzf_fill,
+  .readahead = bgzf_readahead,
+};
+
+XFileHandle mmapFile = {
+  .close = mmap_close,
+  .open = mmap_open,
+  .read = mmap_read,
+  .seek = mmap_seek,
+  .write = mmap_write,
+  .write_format = mmap_write_format,
+  .readline = mmap_readline,
+  .length = mmap_length,
+  .count = mmap_count,
+  .reset = mmap_reset,
+  .fill = mmap_fill,
+  .readahead = mmap_readahead,
+};
+
+// Buffered output. Text is gathered in large buffers and written as is, or
+// cut into BGZF blocks that are deflated in parallel and written in order.
+
+#define BGZF_BLOCK_INPUT 0xff00 // input per block, as bgzip uses
+
+static const unsigned char bgzf_eof_block[28]
+    = { 0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff,
+        0x06, 0x00, 0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+XBuffer*
+xbuffer_new(size_t capacity)
+{
+  XBuffer* buff = dmalloc(sizeof(XBuffer));
+  buff->capacity = capacity < MIN_BUFF_SIZE ? MIN_BUFF_SIZE : capacity;
+  buff->data = dmallocTag(buff->capacity, MEM_TAG_IO);
+  buff->size = 0;
+  return buff;
+}
+
+void
+xbuffer_free(XBuffer* buff)
+{
+  if (buff) {
+    dfreeTag(buff->data, buff->capacity, MEM_TAG_IO);
+    dfree(buff, sizeof(XBuffer));
+  }
+}
+
+static inline void
+xbuffer_reserve(XBuffer* buff, size_t size)
+{
+  if (buff->size + size > buff->capacity) {
+    size_t cap = roundup(buff->size + size);
+    buff->data = dreallocTag(buff->data, buff->capacity, cap, MEM_TAG_IO);
+    buff->capacity = cap;
+  }
+}
+
+void
+xbuffer_write(XBuffer* buff, const char* data, size_t size)
+{
+  xbuffer_reserve(buff, size);
+  memcpy(buff->data + buff->size, data, size);
+  buff->size += size;
+}
+
+size_t
+xbuffer_vprintf(XBuffer* buff, const char* format, va_list args)
+{
+  va_list copy;
+  va_copy(copy, args);
+  size_t room = buff->capacity - buff->size;
+  int n = vsnprintf(buff->data + buff->size, room, format, copy);
+  va_end(copy);
+  if (n < 0) {
+    return 0;
+  }
+  if ((size_t)n >= room) {
+    // vsnprintf needs room for the NUL it writes
+    xbuffer_reserve(buff, n + 1);
+    vsnprintf(buff->data + buff->size, n + 1, format, args);
+  }
+  buff->size += n;
+  return n;
+}
+
+size_t
+xbuffer_printf(XBuffer* buff, const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  size_t n = xbuffer_vprintf(buff, format, args);
+  va_end(args);
+  return n;
+}
+
+// the format a path asks for: BGZF for .gz, which gzip reads too
+XWriterFormat
+xwriter_format_of(const char* path)
+{
+  size_t len = strlen(path);
+  if (len > 3 && strcmp(path + len - 3, ".gz") == 0) {
+    return XWRITER_BGZF;
+  }
+  return XWRITER_PLAIN;
+}
+
+XWriter*
+xwriter_open(const char* path, XWriterFormat format)
+{
+  FILE* fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+  if (fp == NULL) {
+    error("open file %s failed. %s", path, display_error);
+    exit(1);
+  }
+  XWriter* writer = dmalloc(sizeof(XWriter));
+  writer->path = path;
+  writer->fp = fp;
+  writer->format = format;
+  writer->buff = xbuffer_new(XWRITER_BUFF_SIZE);
+  writer->out = NULL;
+  writer->out_size = 0;
+  if (format == XWRITER_BGZF) {
+    size_t nblocks
+        = (XWRITER_BUFF_SIZE + BGZF_BLOCK_INPUT - 1) / BGZF_BLOCK_INPUT + 1;
+    writer->out_size = nblocks * BGZF_MAX_BLOCK_SIZE;
+    writer->out = dmallocTag(writer->out_size, MEM_TAG_IO);
+  }
+  return writer;
+}
+
+static inline void
+xwriter_put(XWriter* writer, const void* data, size_t size)
+{
+  if (size && fwrite(data, 1, size, writer->fp) != size) {
+    error("write %s failed. %s", writer->path, display_error);
+    exit(1);
+  }
+}
+
+// deflate one BGZF block of at most BGZF_BLOCK_INPUT bytes into out, which
+// holds BGZF_MAX_BLOCK_SIZE bytes; returns the block size
+static inline size_t
+bgzf_deflate(const char* data, size_t size, unsigned char* out)
+{
+  for (int level = Z_DEFAULT_COMPRESSION;; level = 0) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(z_stream));
+    if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)
+        != Z_OK) {
+      return 0;
+    }
+    strm.next_in = (Bytef*)data;
+    strm.avail_in = size;
+    strm.next_out = out + BGZF_HEADER_SIZE;
+    strm.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - 8;
+    int ret = deflate(&strm, Z_FINISH);
+    size_t csize = strm.total_out;
+    deflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+      if (level == 0) {
+        return 0;
+      }
+      // incompressible data overflowed the block; store it instead
+      continue;
+    }
+    size_t bsize = BGZF_HEADER_SIZE + csize + 8;
+    memcpy(out, bgzf_eof_block, BGZF_HEADER_SIZE);
+    out[16] = (bsize - 1) & 0xff;
+    out[17] = (bsize - 1) >> 8;
+    uint32_t crc = crc32(0L, (const Bytef*)data, size);
+    unsigned char* tail = out + BGZF_HEADER_SIZE + csize;
+    for (int i = 0; i < 4; i++) {
+      tail[i] = (crc >> (8 * i)) & 0xff;
+      tail[4 + i] = ((uint32_t)size >> (8 * i)) & 0xff;
+    }
+    return bsize;
+  }
+}
+
+static inline void
+xwriter_bgzf(XWriter* writer, const char* data, size_t size)
+{
+  size_t nblocks = (size + BGZF_BLOCK_INPUT - 1) / BGZF_BLOCK_INPUT;
+  size_t* sizes = dmalloc(sizeof(size_t) * (nblocks ? nblocks : 1));
+#ifdef ROA_PARALLEL
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (size_t b = 0; b < nblocks; b++) {
+    size_t start = b * BGZF_BLOCK_INPUT;
+    size_t len = size - start < BGZF_BLOCK_INPUT ? size - start
+                                                 : BGZF_BLOCK_INPUT;
+    sizes[b] = bgzf_deflate(data + start, len,
+                            writer->out + b * BGZF_MAX_BLOCK_SIZE);
+  }
+  for (size_t b = 0; b < nblocks; b++) {
+    if (sizes[b] == 0) {
+      error("compress output of %s failed.", writer->path);
+      exit(1);
+    }
+    xwriter_put(writer, writer->out + b * BGZF_MAX_BLOCK_SIZE, sizes[b]);
+  }
+  dfree(sizes, sizeof(size_t) * (nblocks ? nblocks : 1));
+}
+
+// write out everything buffered so far
+void
+xwriter_flush(XWriter* writer)
+{
+  XBuffer* buff = writer->buff;
+  if (buff->size == 0) {
+    return;
+  }
+  if (writer->format == XWRITER_BGZF) {
+    // the buffer may have grown past one flush worth of blocks
+    for (size_t start = 0; start < buff->size; start += XWRITER_BUFF_SIZE) {
+      size_t len = buff->size - start < XWRITER_BUFF_SIZE ? buff->size - start
+                                                          : XWRITER_BUFF_SIZE;
+      xwriter_bgzf(writer, buff->data + start, len);
+    }
+  } else {
+    xwriter_put(writer, buff->data, buff->size);
+  }
+  buff->size = 0;
+}
+
+void
+xwriter_write(XWriter* writer, const char* data, size_t size)
+{
+  xbuffer_write(writer->buff, data, size);
+  if (writer->buff->size >= XWRITER_BUFF_SIZE) {
+    xwriter_flush(writer);
+  }
+}
+
+size_t
+xwriter_printf(XWriter* writer, const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  size_t n = xbuffer_vprintf(writer->buff, format, args);
+  va_end(args);
+  if (writer->buff->size >= XWRITER_BUFF_SIZE) {
+    xwriter_flush(writer);
+  }
+  return n;
+}
+
+// append the text of a buffer filled elsewhere, e.g. by one thread
+void
+xwriter_append(XWriter* writer, XBuffer* buff)
+{
+  xwriter_write(writer, buff->data, buff->size);
+}
+
+void
+xwriter_close(XWriter* writer)
+{
+  xwriter_flush(writer);
+  if (writer->format == XWRITER_BGZF) {
+    xwriter_put(writer, bgzf_eof_block, sizeof(bgzf_eof_block));
+  }
+  if (writer->out) {
+    dfreeTag(writer->out, writer->out_size, MEM_TAG_IO);
+  }
+  xbuffer_free(writer->buff);
+  if ((writer->fp == stdout ? fflush(stdout) : fclose(writer->fp)) != 0) {
+    error("close %s failed. %s", writer->path, display_error);
+    exit(1);
+  }
+  dfree(writer, sizeof(XWriter));
+}
+
+XFileHandle streamFile = {
+  .close = zip_close,
+  .open = stream_open,
+  .read = zip_read,
+  .seek = zip_seek,
+  .write = zip_write,
+  .write_format = zip_write_format,
+  .readline = zip_readline,
+  .length = zip_length,
+  .count = zip_count,
+  .reset = zip_reset,
+  .fill = zip_fill,
+  .readahead = zip_readahead,
 };
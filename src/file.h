@@ -1,33 +1,64 @@
 #pragma once
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <zconf.h>
 #include <zlib.h>
 
 #include "alloc.h"
 #include "file.h"
+#include "log.h"
 
 #define display_error strerror(errno)
 
 #define MIN_BUFF_SIZE 128               // 128KB
 #define FILE_BUFF_SIZE 1024 * 1024 * 64 // 64MB
+// read-ahead ring: slots filled by the producer thread while the consumer
+// parses the previous one
+#define FILE_AHEAD_SLOTS 4
+#define FILE_AHEAD_SIZE (1024 * 1024 * 16) // 16MB
 
 #define LF '\n'
 #define CR '\r'
 #define CRLF "\r\n"
 
+// a line returned by readline(); line usually points into the file's read
+// buffer and is not NUL terminated
 typedef struct {
-  char* line;
+  char* line;      // size bytes of the line, without the line end
   size_t size;
-  size_t capacity;
+  char* store;     // own storage for lines that straddle a buffer refill
+  size_t capacity; // bytes of store
 } line_t;
 
 typedef struct XFile XFile;
+typedef size_t (*read_t)(XFile* file, size_t size, char* buff);
+
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready; // a slot was filled
+  pthread_cond_t freed; // the consumer gave a slot back
+  XFile* file;
+  read_t read;
+  char* data[FILE_AHEAD_SLOTS];
+  size_t size[FILE_AHEAD_SLOTS];
+  size_t filled;   // slots filled so far
+  size_t taken;    // slots handed to the consumer so far
+  size_t released; // slots given back so far
+  int done;        // the producer reached the end of input
+  int stop;        // the consumer asks the producer to quit
+} XFileAhead;
+
 struct XFile {
   const char* path;
   const char* mode;
@@ -37,10 +68,12 @@ struct XFile {
   long int offset;
   // 文件内容长度
   size_t length;
-  // TODO
-  char buff[FILE_BUFF_SIZE];
+  // current block of input, owned by store or by the read-ahead ring
+  char* buff;
+  char* store;
+  XFileAhead* ahead;
   // buff指针偏移量
-  int buff_offset;
+  size_t buff_offset;
   // buff大小
   size_t buff_size;
   int no_more_data; // for zip file
@@ -59,29 +92,103 @@ typedef struct XFileHandle {
   line_t* (*readline)(XFile* file, line_t* line);
   size_t (*count)(XFile* file, char c);
   int (*reset)(XFile* file);
+  // load the next block of input into buff; 0 at the end
+  size_t (*fill)(XFile* file);
+  // read and inflate on a background thread from now on
+  int (*readahead)(XFile* file);
 } XFileHandle;
 
 extern XFileHandle plainFile;
 extern XFileHandle zipFile;
+extern XFileHandle bgzfFile;
+extern XFileHandle mmapFile;
+extern XFileHandle streamFile;
+
+// growable text buffer, e.g. one per thread of a parallel dump
+typedef struct {
+  char* data;
+  size_t size;
+  size_t capacity;
+} XBuffer;
+
+#define XWRITER_BUFF_SIZE (1024 * 1024 * 4) // 4MB
+
+typedef enum {
+  XWRITER_PLAIN,
+  XWRITER_BGZF,
+} XWriterFormat;
+
+typedef struct {
+  const char* path;
+  FILE* fp;
+  XWriterFormat format;
+  XBuffer* buff;      // text not written yet
+  unsigned char* out; // compressed output
+  size_t out_size;
+} XWriter;
+
+XBuffer* xbuffer_new(size_t capacity);
+void xbuffer_free(XBuffer* buff);
+void xbuffer_write(XBuffer* buff, const char* data, size_t size);
+size_t xbuffer_vprintf(XBuffer* buff, const char* format, va_list args);
+size_t xbuffer_printf(XBuffer* buff, const char* format, ...);
 
+XWriterFormat xwriter_format_of(const char* path);
+XWriter* xwriter_open(const char* path, XWriterFormat format);
+void xwriter_write(XWriter* writer, const char* data, size_t size);
+size_t xwriter_printf(XWriter* writer, const char* format, ...);
+void xwriter_append(XWriter* writer, XBuffer* buff);
+void xwriter_flush(XWriter* writer);
+void xwriter_close(XWriter* writer);
+
+// whether p starts with a BGZF block header (gzip with a "BC" extra field)
+static inline int
+isbgzf_header(const unsigned char* p, size_t n)
+{
+  if (n < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4)) {
+    return 0;
+  }
+  size_t xlen = p[10] | (p[11] << 8);
+  for (size_t x = 12; x + 4 <= 12 + xlen && x + 4 <= n;) {
+    size_t slen = p[x + 2] | (p[x + 3] << 8);
+    if (p[x] == 'B' && p[x + 1] == 'C' && slen == 2) {
+      return 1;
+    }
+    x += 4 + slen;
+  }
+  return 0;
+}
+
+// The handle for reading path: BGZF and gzip by their magic, other regular
+// files are mapped. "-" (stdin), pipes and devices cannot be read twice, so
+// they are not sniffed but streamed through zlib, which inflates gzip and
+// passes plain text through as it goes.
 static inline XFileHandle
 choice_handle(const char* path)
 {
+  if (strcmp(path, "-") == 0) {
+    return streamFile;
+  }
   FILE* fp = fopen(path, "rb");
   if (fp == NULL) {
-    printf("open file error: %s\n", display_error);
+    fprintf(stderr, "Open file: %s failed. %s\n", path, display_error);
     exit(1);
   }
-  unsigned char buff[2];
-  size_t size = fread(buff, sizeof(char), 2, fp);
-  if (size < 2) {
-    return plainFile;
+  struct stat st;
+  if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+    fclose(fp);
+    return streamFile;
   }
+  unsigned char buff[64];
+  size_t size = fread(buff, sizeof(char), sizeof(buff), fp);
   fclose(fp);
-  if (buff[0] == 0x1f && buff[1] == 0x8b) {
+  if (size >= 2 && isbgzf_header(buff, size)) {
+    return bgzfFile;
+  }
+  if (size >= 2 && buff[0] == 0x1f && buff[1] == 0x8b) {
     return zipFile;
   }
-  return plainFile;
+  return mmapFile;
 }
 
 #define readline_iter(handle, file, line)                                     \
@@ -0,0 +1,143 @@
+#pragma once
+#include "alloc.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Open addressing hash set of 64-bit packed kmers with linear probing. Keys
+// are at most 62 bits wide (k <= 31), so all ones marks an empty slot. The
+// table is one flat array and can be written to disk or mapped back as is.
+// Inserts use compare-and-swap, so threads may fill the same set as long as
+// kmersetReserve() made room beforehand.
+
+#define KMERSET_EMPTY UINT64_MAX
+#define KMERSET_MIN_CAPACITY 1024
+
+typedef struct {
+  size_t capacity; // power of two
+  size_t count;
+  uint64_t* slots;
+} KmerSet;
+
+static inline uint64_t
+kmersetHash(uint64_t key)
+{
+  // splitmix64 finalizer
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return key;
+}
+
+static inline KmerSet*
+kmersetNew(size_t capacity)
+{
+  if (capacity < KMERSET_MIN_CAPACITY) {
+    capacity = KMERSET_MIN_CAPACITY;
+  }
+  KmerSet* set = dmalloc(sizeof(KmerSet));
+  set->capacity = roundup(capacity);
+  set->count = 0;
+  set->slots = dmalloc(sizeof(uint64_t) * set->capacity);
+  memset(set->slots, 0xff, sizeof(uint64_t) * set->capacity);
+  return set;
+}
+
+static inline void
+kmersetFree(KmerSet* set)
+{
+  if (set == NULL) {
+    return;
+  }
+  dfree(set->slots, sizeof(uint64_t) * set->capacity);
+  dfree(set, sizeof(KmerSet));
+}
+
+static inline size_t
+kmersetSlot(KmerSet* set, uint64_t key)
+{
+  return kmersetHash(key) & (set->capacity - 1);
+}
+
+// probe from slot, which must be kmersetSlot(set, key)
+static inline int
+kmersetProbe(KmerSet* set, uint64_t key, size_t slot)
+{
+  size_t mask = set->capacity - 1;
+  while (1) {
+    uint64_t cur = set->slots[slot];
+    if (cur == key) {
+      return 1;
+    }
+    if (cur == KMERSET_EMPTY) {
+      return 0;
+    }
+    slot = (slot + 1) & mask;
+  }
+}
+
+static inline int
+kmersetContains(KmerSet* set, uint64_t key)
+{
+  return kmersetProbe(set, key, kmersetSlot(set, key));
+}
+
+// insert key, safe against concurrent inserts; returns 1 if it was new
+static inline int
+kmersetInsert(KmerSet* set, uint64_t key)
+{
+  size_t mask = set->capacity - 1;
+  size_t slot = kmersetSlot(set, key);
+  while (1) {
+    uint64_t cur = __atomic_load_n(&set->slots[slot], __ATOMIC_RELAXED);
+    if (cur == KMERSET_EMPTY) {
+      if (__atomic_compare_exchange_n(&set->slots[slot], &cur, key, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&set->count, 1, __ATOMIC_RELAXED);
+        return 1;
+      }
+      // lost the slot, cur now holds the winner's key
+    }
+    if (cur == key) {
+      return 0;
+    }
+    slot = (slot + 1) & mask;
+  }
+}
+
+// grow the table so that n keys stay below half load; not thread safe
+static inline void
+kmersetReserve(KmerSet* set, size_t n)
+{
+  if (n * 2 <= set->capacity) {
+    return;
+  }
+  size_t capacity = set->capacity;
+  uint64_t* slots = set->slots;
+  set->capacity = roundup(n * 2);
+  set->count = 0;
+  set->slots = dmalloc(sizeof(uint64_t) * set->capacity);
+  memset(set->slots, 0xff, sizeof(uint64_t) * set->capacity);
+#ifdef ROA_PARALLEL
+#pragma omp parallel for
+#endif
+  for (size_t i = 0; i < capacity; i++) {
+    if (slots[i] != KMERSET_EMPTY) {
+      kmersetInsert(set, slots[i]);
+    }
+  }
+  dfree(slots, sizeof(uint64_t) * capacity);
+}
+
+// run body with key bound to every member, in table order
+#define kmersetForeach(set, key, body)                                        \
+  do {                                                                        \
+    for (size_t __i = 0; __i < (set)->capacity; __i++) {                      \
+      uint64_t key = (set)->slots[__i];                                       \
+      if (key != KMERSET_EMPTY) {                                             \
+        body;                                                                 \
+      }                                                                       \
+    }                                                                         \
+  } while (0)
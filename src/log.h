@@ -91,9 +91,9 @@ __pglog_print(int level, FILE* stream, const char* header)
 
 #define __log2terminal(level, ...)                                            \
   do {                                                                        \
-    FILE* __tfp = level == PGLOG_LEVEL_ERROR ? stderr : stdout;               \
-    if (!ISATTY(__tfp) || !ISATTY(stdout) || !ISATTY(stderr)) {               \
-      __tfp = stdout;                                                         \
+    /* stdout is left to data, e.g. streamed designs */                       \
+    FILE* __tfp = stderr;                                                     \
+    if (!ISATTY(__tfp)) {                                                     \
       FILE* __fp = __pglog_print_file(level, __tfp,                           \
                                       __header(__FILE__, STR(__LINE__)));     \
       if (__fp) {                                                             \
@@ -1,18 +1,35 @@
 #include "alloc.h"
+#include "arena.h"
 #include "arg.h"
 #include "array.h"
 #include "bitarray.h"
+#include "faidx.h"
 #include "file.h"
+#include "kmerset.h"
 #include "log.h"
+#include "mempolicy.h"
+#include "pack.h"
+#include "roaring.h"
 #include "seq.h"
+#include "twobit.h"
+#include "vec.h"
 
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <zlib.h>
 
+#ifdef ROA_PARALLEL
+#include <omp.h>
+#endif
+
 // I follow the rule of primer design from Qiagen
 // https://www.qiagen.com/zh-us/knowledge-and-support/knowledge-hub/bench-guide/pcr/introduction/pcr-primer-design
 
@@ -45,11 +62,22 @@ static inline void int2KmerString(uint64_t kmer, int k, char *buff) {
 // clang-format on
 
 #define SEQ_MAX_LEN (1UL << 29) - 1
-#define KMER_MASK (1UL << 32) - 1
+// kmer length is fixed at compile time: make K=21
+#ifndef KMER_LEN
 #define KMER_LEN 16
+#endif
+#if KMER_LEN < 1 || KMER_LEN > 31
+#error "KMER_LEN must be between 1 and 31"
+#endif
+#define KMER_BITS (KMER_LEN * 2)
+#define KMER_MASK ((1ULL << KMER_BITS) - 1)
+// the direct-address reprs (dense and sparse) key on 32-bit kmers
+#define KMER_DIRECT (KMER_LEN <= 16)
 #define KMER_LONG_LEN 20
 #define KMER_LONG_MASK (1ULL << 40) - 1
 #define KMER_PER_CIRCLE 4
+// rows per task of a parallel text dump
+#define DUMP_CHUNK_ROWS 4096
 
 static inline int
 isFileExist(const char* path)
@@ -62,323 +90,1685 @@ isFileExist(const char* path)
   return 1;
 }
 
+// stdin ("-"), a pipe or a device: it can be read only once
+static inline int
+isStreamPath(const char* path)
+{
+  struct stat st;
+  return strcmp(path, "-") == 0 || stat(path, &st) != 0
+         || !S_ISREG(st.st_mode);
+}
+
+#if KMER_DIRECT
+typedef uint32_t kmer_t;
+#else
+typedef uint64_t kmer_t;
+#endif
+
+// Kmers of every query record in one table with a slot per start position,
+// records one after another. Slots without a kmer (it would cover an N or
+// end in the last KMER_LEN - 1 bases) start dropped, so a slot always sits
+// at offsets[record] + position.
 typedef struct {
-  // 16-bit kmer
-  int pos : 30;
-  int drop : 1;
-  int strand : 1;
-  uint64_t kmer : 32;
-  uint64_t reverse_kmer : 32;
-} Kmer;
+  size_t size;     // slots
+  size_t nrecords; // records, of the query batch
+  size_t* offsets; // nrecords + 1, first slot of every record
+  kmer_t* fwd;     // forward kmers, first base in the high bits
+  kmer_t* rev;     // their reverse complements
+  uint32_t* pos;   // start of the kmer in its record
+  uint64_t* drop;  // (size + 63) / 64 words, bit set for dropped slots
+} KmerTable;
 
 typedef struct {
-  Array* kmers; // Array<Array<Kmer>>
-  Array* seqs;  // Array<Seq*>
+  KmerTable* kmers;
+  SeqBatch* batch; // the records, kmers->offsets follow its order
+  MemTag tag;      // of the stage that made the query, charged for all of it
 } Query;
 
+VEC_DEFINE(IdVec, size_t)
+
 typedef struct Segment Segment;
 struct Segment {
-  int id;          // id of the segment
-  char* name;      // name of the segment
-  size_t start;    // start position of the segment
-  size_t end;      // end position of the segment
-  BitArray* bases; // bases of the segment
-  int vaild;       // if the segment is vaild
-  float Tm;        // pcr melting temperature
+  int id;              // id of the segment
+  char* name;          // name of the segment
+  size_t start;        // start position of the segment
+  size_t end;          // end position of the segment
+  uint64_t kmer;       // probes: their KMER_LONG_LEN bases, first base high
+  const kmer_t* kmers; // parents: query table kmers of the segment slots
+  size_t len;          // parents: bases of the segment
+  int vaild;           // if the segment is vaild
+  float Tm;            // pcr melting temperature
 };
 
-typedef struct {
+// base i of a parent segment: the first kmer, then the last base of each
+// following one
+static inline int
+segmentBase(const Segment* s, size_t i)
+{
+  if (i < KMER_LEN) {
+    return (s->kmers[0] >> (2 * (KMER_LEN - 1 - i))) & 3;
+  }
+  return s->kmers[i - KMER_LEN + 1] & 3;
+}
+
+VEC_DEFINE(SegmentVec, Segment)
+VEC_DEFINE(SegmentRefVec, Segment*)
+
+typedef enum {
+  INDEX_REPR_DENSE,  // direct-address bitmap over all 4^k kmers
+  INDEX_REPR_SPARSE, // roaring-style set of the kmers present
+  INDEX_REPR_HASH,   // hash set of 64-bit kmers, any k up to 31
+} IndexRepr;
+
+typedef struct Index Index;
+struct Index {
   const char* path;
-  BitArray* index;
-} Index;
+  IndexRepr repr;
+  BitArray* index; // INDEX_REPR_DENSE
+  Roaring* sparse; // INDEX_REPR_SPARSE
+  KmerSet* hash;   // INDEX_REPR_HASH
+  void* map;       // file mapping backing the data, NULL if owned
+  size_t mapSize;  // length of the mapping
+  // membership indexes: slot bit i is set if reference i contains the kmer
+  int nref;           // number of references, 0 for a plain index
+  char* names;        // nref NUL terminated reference names, back to back
+  size_t namesSize;   // bytes of names
+  unsigned char mask; // slot bits that count as a hit, all by default
+  int canonical;      // only min(kmer, reverse complement) is stored
+  // per NUMA node copies made by placeIndex(), replicas[0] is the index
+  Index** replicas;
+  int nreplica;
+  MemTag tag; // of the stage that made the index, charged for all of it
+};
+
+// at most 8 references fit in the widest BitArray slot
+#define INDEX_MAX_REFS 8
+
+typedef enum {
+  INDEX_FORMAT_GZIP,  // IndexHeader + data in one gzip stream, read only
+  INDEX_FORMAT_RAW,   // IndexHeader + page aligned data, mmap friendly
+  INDEX_FORMAT_BLOCK, // IndexHeader + zlib blocks + block offset table
+} IndexFormat;
+
+#define INDEX_MAGIC "ROAINDEX"
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 256
+#define INDEX_PAGE_SIZE 4096
+// uncompressed bytes per independently deflated block
+#define INDEX_BLOCK_SIZE (1UL << 22)
+
+// fixed size header at the start of every non-legacy index file
+typedef struct {
+  char magic[8];       // INDEX_MAGIC
+  uint32_t version;    // INDEX_VERSION
+  uint32_t k;          // kmer length the index was built with
+  uint32_t nbit;       // bits per kmer slot
+  uint32_t format;     // IndexFormat
+  uint64_t size;       // kmer slots (dense) or kmers present (sparse)
+  uint64_t dataSize;   // bytes of data
+  uint64_t dataOffset; // offset of the data, page aligned for raw files
+  uint32_t repr;       // IndexRepr
+  uint32_t blockSize;  // uncompressed bytes per block (block format)
+  uint32_t nref;       // references of a membership index, 0 otherwise
+  uint32_t namesSize;  // bytes of reference names following the header
+  uint32_t canonical;  // 1 if only canonical kmers are stored
+  uint8_t reserved[INDEX_HEADER_SIZE - 68];
+} IndexHeader;
 
 static inline Index*
-createIndex(Index* index, const char* path)
+newIndex(const char* path, IndexRepr repr)
 {
-  if (index == NULL) {
-    index = dmalloc(sizeof(Index));
-    index->path = path;
-    index->index = bitarrayNew(KMER_MASK + 1, 1);
+  Index* index = dmalloc(sizeof(Index));
+  index->path = path;
+  index->repr = repr;
+  index->index = NULL;
+  index->sparse = NULL;
+  index->hash = NULL;
+  index->map = NULL;
+  index->mapSize = 0;
+  index->nref = 0;
+  index->names = NULL;
+  index->namesSize = 0;
+  index->mask = 0xff;
+  index->canonical = 0;
+  index->replicas = NULL;
+  index->nreplica = 0;
+  index->tag = memTag();
+  return index;
+}
+
+static inline void
+freeIndex(Index* index)
+{
+  // whatever the stage, the index is freed under the tag it was made under
+  int old = memSetThreadTag(index->tag);
+  for (int i = 1; i < index->nreplica; i++) {
+    freeIndex(index->replicas[i]);
   }
-  unsigned char basemap[128] = { 4 };
-  create_base2int(basemap);
-  Seq* seq = NULL;
-  {
-    iter_fasta(path, seq)
-    {
-      uint32_t kmer = 0;
-      uint32_t reverse_kmer = 0;
-      char c = 4;
-      size_t count = 0;
-      for (size_t i = 0; i < seq->len - KMER_LEN + 1; i++) {
-        c = basemap[seq->seq[i]];
-        if (c == 4) {
-          kmer = 0;
-          reverse_kmer = 0;
-          count = 0;
-          continue;
-        }
-        kmer = (kmer << 2) | (c & 0x3) & KMER_MASK;
-        reverse_kmer = (reverse_kmer >> 2) | ((0x00000003 - c) << 30);
-        count++;
-        if (count < KMER_LEN) {
-          continue;
+  if (index->replicas) {
+    dfree(index->replicas, sizeof(Index*) * index->nreplica);
+  }
+  if (index->map) {
+    munmap(index->map, index->mapSize);
+    if (index->repr == INDEX_REPR_SPARSE) {
+      dfree(index->sparse, sizeof(Roaring));
+    } else if (index->repr == INDEX_REPR_HASH) {
+      dfree(index->hash, sizeof(KmerSet));
+    } else {
+      dfree(index->index, sizeof(BitArray));
+    }
+  } else {
+    bitarrayFree(index->index);
+    roaringFree(index->sparse);
+    kmersetFree(index->hash);
+  }
+  if (index->names) {
+    dfree(index->names, index->namesSize);
+  }
+  dfree(index, sizeof(Index));
+  memSetThreadTag(old);
+}
+
+static inline int
+indexHas(Index* index, kmer_t kmer)
+{
+  if (index->nreplica && memNode() < index->nreplica) {
+    index = index->replicas[memNode()];
+  }
+  if (index->repr == INDEX_REPR_HASH) {
+    return kmersetContains(index->hash, kmer);
+  }
+  if (index->repr == INDEX_REPR_SPARSE) {
+    return roaringContains(index->sparse, kmer);
+  }
+  return bitarrayGet(index->index, kmer) & index->mask;
+}
+
+static inline kmer_t
+canonicalKmer(kmer_t kmer, kmer_t reverse_kmer)
+{
+  return kmer < reverse_kmer ? kmer : reverse_kmer;
+}
+
+// whether the index holds the kmer on either strand
+static inline int
+indexHasKmer(Index* index, kmer_t kmer, kmer_t reverse_kmer)
+{
+  if (index->canonical) {
+    return indexHas(index, canonicalKmer(kmer, reverse_kmer));
+  }
+  return indexHas(index, kmer) || indexHas(index, reverse_kmer);
+}
+
+// kmers looked up together; hash probes are prefetched a batch ahead
+#define INDEX_LOOKUP_BATCH 32
+
+// hit[i] = indexHas(index, keys[i]) for n <= INDEX_LOOKUP_BATCH keys
+static inline void
+indexHasBatch(Index* index, const kmer_t* keys, size_t n, unsigned char* hit)
+{
+  if (index->nreplica && memNode() < index->nreplica) {
+    index = index->replicas[memNode()];
+  }
+  if (index->repr != INDEX_REPR_HASH) {
+    for (size_t i = 0; i < n; i++) {
+      hit[i] = indexHas(index, keys[i]) != 0;
+    }
+    return;
+  }
+  size_t slots[INDEX_LOOKUP_BATCH];
+  for (size_t i = 0; i < n; i++) {
+    slots[i] = kmersetSlot(index->hash, keys[i]);
+    __builtin_prefetch(&index->hash->slots[slots[i]]);
+  }
+  for (size_t i = 0; i < n; i++) {
+    hit[i] = kmersetProbe(index->hash, keys[i], slots[i]);
+  }
+}
+
+// an empty membership index over nref references, with slots just wide
+// enough for one bit per reference
+static inline Index*
+newMembershipIndex(const char* path, Array* refs)
+{
+  Index* index = newIndex(path, INDEX_REPR_DENSE);
+  index->nref = refs->size;
+  int nbit = 1;
+  while (nbit < index->nref) {
+    nbit *= 2;
+  }
+  index->index = bitarrayNew(KMER_MASK + 1, nbit);
+  for (size_t i = 0; i < refs->size; i++) {
+    index->namesSize += strlen(refs->data[i]) + 1;
+  }
+  index->names = dmalloc(index->namesSize);
+  char* name = index->names;
+  for (size_t i = 0; i < refs->size; i++) {
+    size_t len = strlen(refs->data[i]) + 1;
+    memcpy(name, refs->data[i], len);
+    name += len;
+  }
+  return index;
+}
+
+// name of reference i of a membership index
+static inline const char*
+indexRefName(Index* index, int i)
+{
+  const char* name = index->names;
+  while (i-- > 0) {
+    name += strlen(name) + 1;
+  }
+  return name;
+}
+
+// Only count hits in the references listed in the comma separated names.
+// A reference matches by the name it was indexed with, its file name or
+// its number.
+static inline void
+selectIndexRefs(Index* index, const char* names)
+{
+  if (index->nref == 0) {
+    error("index %s is not a membership index, -exclude needs one.",
+          index->path);
+    exit(1);
+  }
+  index->mask = 0;
+  const char* item = names;
+  while (*item) {
+    size_t len = strcspn(item, ",");
+    int found = -1;
+    for (int i = 0; i < index->nref && found < 0; i++) {
+      const char* name = indexRefName(index, i);
+      const char* base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+      char number[16];
+      snprintf(number, sizeof(number), "%d", i);
+      if ((strlen(name) == len && strncmp(name, item, len) == 0)
+          || (strlen(base) == len && strncmp(base, item, len) == 0)
+          || (strlen(number) == len && strncmp(number, item, len) == 0)) {
+        found = i;
+      }
+    }
+    if (found < 0) {
+      error("reference %.*s is not in index %s.", (int)len, item,
+            index->path);
+      exit(1);
+    }
+    index->mask |= 1 << found;
+    item += len;
+    if (*item == ',') {
+      item++;
+    }
+  }
+}
+
+// record that reference bit of a membership index holds every kmer of src
+static inline void
+addMembership(Index* index, Index* src, int bit)
+{
+  BitArray* dst = index->index;
+  BitArray* bits = src->index;
+  int nbit = dst->nbit;
+#ifdef ROA_PARALLEL
+#pragma omp parallel for
+#endif
+  for (size_t b = 0; b < bits->__realCols; b++) {
+    unsigned char byte = bits->data[b];
+    while (byte) {
+      size_t slot = b * 8 + __builtin_ctz(byte);
+      dst->data[slot * nbit / 8] |= (1 << bit) << (slot * nbit % 8);
+      byte &= byte - 1;
+    }
+  }
+}
+
+// bases handed to one build task; long records are cut into several tasks
+#define INDEX_CHUNK_LEN (1UL << 20)
+// bases buffered from the reference before the batch is indexed in parallel
+#define INDEX_BATCH_LEN (1UL << 26)
+// kmers collected before they are sorted into the index (sparse or bucket)
+#define INDEX_KEYS_LEN (1UL << 25)
+// a bucket covers 2^21 bits = 256KB of bitmap, small enough to stay in L2
+#define INDEX_BUCKET_SHIFT 21
+#define INDEX_BUCKETS (1UL << (32 - INDEX_BUCKET_SHIFT))
+
+typedef enum {
+  INDEX_BUILD_DIRECT, // set bits in the bitmap as kmers are found
+  INDEX_BUILD_BUCKET, // radix-partition kmers by high bits, then set bits
+} IndexBuild;
+
+typedef struct {
+  IndexRepr repr;
+  IndexBuild build;
+  int canonical; // store one kmer per strand pair
+} IndexOpts;
+
+typedef struct {
+  Seq* seq;              // bases as text, or
+  TwoBitRecord* record;  // bases already packed
+  size_t start; // first position whose kmer is emitted
+  size_t end;   // one past the last position
+  uint32_t* keys; // sparse and bucketed builds: kmers found by this task
+  size_t nkeys;
+} IndexTask;
+
+// Scan positions [start, end) of seq exactly like a serial walk from 0 would:
+// the walk starts KMER_LEN - 1 bases early so the first kmer of the chunk is
+// already complete, and every kmer it completes ends at or after start. The
+// range is packed into the caller's per-thread buffer first. Direct dense
+// builds write into the shared bitmap atomically, the others append to the
+// task's own key buffer.
+static inline void
+indexSeqRange(Index* index, Packed* packed, IndexTask* task)
+{
+  size_t begin = task->start > KMER_LEN - 1 ? task->start - (KMER_LEN - 1) : 0;
+  if (task->record) {
+    twobitPack(task->record, begin, task->end - begin, packed);
+  } else {
+    packBases(packed, task->seq->seq + begin, task->end - begin);
+  }
+  uint32_t* keys = task->keys;
+  packForeachKmer(packed, KMER_LEN, fwd, rev, pos, {
+    kmer_t kmer = fwd;
+    kmer_t reverse_kmer = rev;
+    if (index->canonical) {
+      kmer_t key = canonicalKmer(kmer, reverse_kmer);
+      if (keys) {
+        keys[task->nkeys++] = (uint32_t)key;
+      } else if (index->repr == INDEX_REPR_HASH) {
+        kmersetInsert(index->hash, key);
+      } else {
+        bitarraySetAtomic(index->index, key, 1);
+      }
+    } else if (keys) {
+      keys[task->nkeys++] = (uint32_t)reverse_kmer;
+      keys[task->nkeys++] = (uint32_t)kmer;
+    } else if (index->repr == INDEX_REPR_HASH) {
+      kmersetInsert(index->hash, reverse_kmer);
+      kmersetInsert(index->hash, kmer);
+    } else {
+      bitarraySetAtomic(index->index, reverse_kmer, 1);
+      bitarraySetAtomic(index->index, kmer, 1);
+    }
+  });
+}
+
+// Partition keys by their top bits into tmp and set the bits bucket by
+// bucket: each bucket only touches its own L2-sized slice of the bitmap, so
+// the writes are cache local and buckets need no atomics between threads.
+static inline void
+indexBucketKeys(BitArray* bits, const uint32_t* keys, size_t n, uint32_t* tmp)
+{
+  int nthreads = 1;
+#ifdef ROA_PARALLEL
+  nthreads = omp_get_max_threads();
+#endif
+  size_t histSize = sizeof(size_t) * INDEX_BUCKETS * nthreads;
+  size_t* hist = dmalloc(histSize);
+  size_t* starts = dmalloc(sizeof(size_t) * (INDEX_BUCKETS + 1));
+  memset(hist, 0, histSize);
+#ifdef ROA_PARALLEL
+#pragma omp parallel for
+#endif
+  for (int t = 0; t < nthreads; t++) {
+    size_t* h = hist + (size_t)t * INDEX_BUCKETS;
+    for (size_t i = n * t / nthreads; i < n * (t + 1) / nthreads; i++) {
+      h[keys[i] >> INDEX_BUCKET_SHIFT]++;
+    }
+  }
+  size_t offset = 0;
+  for (size_t b = 0; b < INDEX_BUCKETS; b++) {
+    starts[b] = offset;
+    for (int t = 0; t < nthreads; t++) {
+      size_t count = hist[(size_t)t * INDEX_BUCKETS + b];
+      hist[(size_t)t * INDEX_BUCKETS + b] = offset;
+      offset += count;
+    }
+  }
+  starts[INDEX_BUCKETS] = offset;
+#ifdef ROA_PARALLEL
+#pragma omp parallel for
+#endif
+  for (int t = 0; t < nthreads; t++) {
+    size_t* h = hist + (size_t)t * INDEX_BUCKETS;
+    for (size_t i = n * t / nthreads; i < n * (t + 1) / nthreads; i++) {
+      tmp[h[keys[i] >> INDEX_BUCKET_SHIFT]++] = keys[i];
+    }
+  }
+  unsigned char* data = bits->data;
+#ifdef ROA_PARALLEL
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+  for (size_t b = 0; b < INDEX_BUCKETS; b++) {
+    for (size_t i = starts[b]; i < starts[b + 1]; i++) {
+      data[tmp[i] >> 3] |= 1 << (tmp[i] & 7);
+    }
+  }
+  dfree(starts, sizeof(size_t) * (INDEX_BUCKETS + 1));
+  dfree(hist, histSize);
+}
+
+// split a record of len bases, given as seq or record, into tasks
+static inline void
+indexAddTasks(Array* tasks, Seq* seq, TwoBitRecord* record, size_t len)
+{
+  if (len < KMER_LEN) {
+    return;
+  }
+  // the last KMER_LEN - 1 positions never start a scan, as in the original
+  // serial loop
+  size_t end = len - KMER_LEN + 1;
+  for (size_t start = 0; start < end; start += INDEX_CHUNK_LEN) {
+    IndexTask* task = dmalloc(sizeof(IndexTask));
+    task->seq = seq;
+    task->record = record;
+    task->start = start;
+    task->end = start + INDEX_CHUNK_LEN < end ? start + INDEX_CHUNK_LEN : end;
+    task->keys = NULL;
+    task->nkeys = 0;
+    arrayPush(tasks, task);
+  }
+}
+
+// run and free tasks
+static inline void
+indexTasks(Index* index, Array* tasks, IndexOpts* opts)
+{
+  // Sparse and bucketed builds collect kmers first. Every position yields at
+  // most two (one when canonical), so tasks are run in groups that fit
+  // INDEX_KEYS_LEN and each task of a group gets a fixed slice of one shared
+  // buffer. Hash builds use the same groups to grow the table before the
+  // group inserts into it.
+  int collect = index->repr == INDEX_REPR_SPARSE
+                || (index->repr == INDEX_REPR_DENSE
+                    && opts->build == INDEX_BUILD_BUCKET);
+  int grouped = collect || index->repr == INDEX_REPR_HASH;
+  size_t perPos = index->canonical ? 1 : 2;
+  size_t cap = INDEX_KEYS_LEN > INDEX_CHUNK_LEN * 2 ? INDEX_KEYS_LEN
+                                                    : INDEX_CHUNK_LEN * 2;
+  uint32_t* keys = NULL;
+  uint32_t* tmp = NULL;
+  if (collect) {
+    keys = dmalloc(sizeof(uint32_t) * cap);
+  }
+  if (collect && index->repr == INDEX_REPR_DENSE) {
+    tmp = dmalloc(sizeof(uint32_t) * cap);
+  }
+#ifdef ROA_PARALLEL
+  int nthreads = omp_get_max_threads();
+#else
+  int nthreads = 1;
+#endif
+  Packed** packs = dmalloc(sizeof(Packed*) * nthreads);
+  for (int t = 0; t < nthreads; t++) {
+    packs[t] = packedNew(INDEX_CHUNK_LEN + KMER_LEN);
+  }
+  size_t first = 0;
+  while (first < tasks->size) {
+    size_t last = tasks->size;
+    if (grouped) {
+      size_t used = 0;
+      for (last = first; last < tasks->size; last++) {
+        IndexTask* task = tasks->data[last];
+        size_t need = (task->end - task->start) * perPos;
+        if (used + need > cap) {
+          break;
         }
-        bitarraySet(index->index, reverse_kmer, 1);
-        bitarraySet(index->index, kmer, 1);
+        task->keys = collect ? keys + used : NULL;
+        used += need;
+      }
+      if (index->repr == INDEX_REPR_HASH) {
+        kmersetReserve(index->hash, index->hash->count + used);
+      }
+    }
+#ifdef ROA_PARALLEL
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (size_t i = first; i < last; i++) {
+#ifdef ROA_PARALLEL
+      Packed* packed = packs[omp_get_thread_num()];
+#else
+      Packed* packed = packs[0];
+#endif
+      indexSeqRange(index, packed, tasks->data[i]);
+    }
+    if (collect) {
+      size_t nkeys = 0;
+      for (size_t i = first; i < last; i++) {
+        IndexTask* task = tasks->data[i];
+        memmove(keys + nkeys, task->keys, sizeof(uint32_t) * task->nkeys);
+        nkeys += task->nkeys;
+      }
+      if (index->repr == INDEX_REPR_SPARSE) {
+        Roaring* found = roaringFromKeys(keys, nkeys);
+        Roaring* merged = roaringUnion(index->sparse, found);
+        roaringFree(found);
+        roaringFree(index->sparse);
+        index->sparse = merged;
+      } else {
+        indexBucketKeys(index->index, keys, nkeys, tmp);
       }
     }
+    first = last;
+  }
+  if (keys) {
+    dfree(keys, sizeof(uint32_t) * cap);
+  }
+  if (tmp) {
+    dfree(tmp, sizeof(uint32_t) * cap);
   }
+  for (int t = 0; t < nthreads; t++) {
+    packedFree(packs[t]);
+  }
+  dfree(packs, sizeof(Packed*) * nthreads);
+  for (size_t i = 0; i < tasks->size; i++) {
+    dfree(tasks->data[i], sizeof(IndexTask));
+  }
+  arrayFree(tasks);
+}
+
+static inline void
+indexBatch(Index* index, SeqBatch* batch, IndexOpts* opts)
+{
+  Array* tasks = arrayNew(batch->size + 1);
+  for (size_t i = 0; i < batch->size; i++) {
+    indexAddTasks(tasks, batch->seqs + i, NULL, batch->seqs[i].len);
+  }
+  indexTasks(index, tasks, opts);
+}
+
+// .2bit references need no parsing: tasks pack their range of a record
+// straight from the mapped file, INDEX_BATCH_LEN bases at a time
+static inline void
+indexTwoBit(Index* index, const char* path, IndexOpts* opts)
+{
+  TwoBit* tb = twobitOpen(path);
+  size_t i = 0;
+  while (i < tb->nrecords) {
+    Array* tasks = arrayNew(16);
+    size_t bases = 0;
+    for (; i < tb->nrecords && bases < INDEX_BATCH_LEN; i++) {
+      TwoBitRecord* record = tb->records + i;
+      indexAddTasks(tasks, NULL, record, record->size);
+      bases += record->size;
+    }
+    indexTasks(index, tasks, opts);
+  }
+  debug("finish read 2bit file: %s", path);
+  twobitClose(tb);
+}
+
+static inline Index*
+createIndex(Index* index, const char* path, IndexOpts* opts)
+{
+  if (index == NULL) {
+    index = newIndex(path, opts->repr);
+    if (opts->repr == INDEX_REPR_HASH) {
+      index->hash = kmersetNew(0);
+    } else if (opts->repr == INDEX_REPR_SPARSE) {
+      index->sparse = roaringFromKeys(NULL, 0);
+    } else {
+      index->index = bitarrayNew(KMER_MASK + 1, 1);
+    }
+    index->canonical = opts->canonical;
+  }
+  if (istwobit(path)) {
+    indexTwoBit(index, path, opts);
+    return index;
+  }
+  // the next batch is parsed while the workers index the current one
+  SeqReader* reader = seq_reader_open(path);
+  SeqBatch* batch = seq_batch_new();
+  SeqBatch* next = seq_batch_new();
+  seq_reader_read(reader, batch, 0, INDEX_BATCH_LEN);
+  while (batch->size) {
+    seq_reader_start(reader, next, 0, INDEX_BATCH_LEN);
+    indexBatch(index, batch, opts);
+    seq_reader_wait(reader);
+    SeqBatch* done = batch;
+    batch = next;
+    next = done;
+  }
+  seq_reader_close(reader);
+  seq_batch_free(batch);
+  seq_batch_free(next);
   return index;
 }
 
+// the data of an index as at most two contiguous pieces, in file order
+static inline int
+indexData(Index* index, const void** parts, size_t* sizes)
+{
+  if (index->repr == INDEX_REPR_HASH) {
+    parts[0] = index->hash->slots;
+    sizes[0] = sizeof(uint64_t) * index->hash->capacity;
+    return 1;
+  }
+  if (index->repr == INDEX_REPR_SPARSE) {
+    parts[0] = index->sparse->offsets;
+    sizes[0] = roaringOffsetsBytes();
+    parts[1] = index->sparse->words;
+    sizes[1] = sizeof(uint16_t) * index->sparse->nwords;
+    return 2;
+  }
+  parts[0] = index->index->data;
+  sizes[0] = index->index->__realCols;
+  return 1;
+}
+
+static inline IndexHeader
+indexHeader(Index* index, IndexFormat format)
+{
+  IndexHeader header;
+  memset(&header, 0, sizeof(IndexHeader));
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version = INDEX_VERSION;
+  header.k = KMER_LEN;
+  header.format = format;
+  header.repr = index->repr;
+  if (index->repr == INDEX_REPR_HASH) {
+    header.nbit = 1;
+    header.size = index->hash->count;
+    header.dataSize = sizeof(uint64_t) * index->hash->capacity;
+  } else if (index->repr == INDEX_REPR_SPARSE) {
+    header.nbit = 1;
+    header.size = index->sparse->cardinality;
+    header.dataSize = roaringBytes(index->sparse);
+  } else {
+    header.nbit = index->index->nbit;
+    header.size = index->index->size;
+    header.dataSize = index->index->__realCols;
+  }
+  header.nref = index->nref;
+  header.namesSize = index->namesSize;
+  header.canonical = index->canonical;
+  header.dataOffset = INDEX_HEADER_SIZE + index->namesSize;
+  if (format == INDEX_FORMAT_RAW) {
+    header.dataOffset = (header.dataOffset + INDEX_PAGE_SIZE - 1)
+                        / INDEX_PAGE_SIZE * INDEX_PAGE_SIZE;
+  }
+  header.blockSize = format == INDEX_FORMAT_BLOCK ? INDEX_BLOCK_SIZE : 0;
+  return header;
+}
+
+// copy [offset, offset + size) of the data pieces, seen as one buffer
 static inline void
-dumpIndex(Index* index, const char* path)
-{
-  gzFile fp = gzopen(path, "wb");
-  gzwrite(fp, &index->index->size, sizeof(size_t));
-  gzwrite(fp, &index->index->mask, sizeof(char));
-  gzwrite(fp, &index->index->nbit, sizeof(int));
-  gzwrite(fp, &index->index->__realCols, sizeof(size_t));
-  gzwrite(fp, index->index->data, sizeof(uint8_t) * index->index->__realCols);
-  gzclose(fp);
+copyIndexData(const void** parts,
+              size_t* sizes,
+              int nparts,
+              size_t offset,
+              size_t size,
+              unsigned char* out)
+{
+  for (int i = 0; i < nparts && size; i++) {
+    if (offset >= sizes[i]) {
+      offset -= sizes[i];
+      continue;
+    }
+    size_t n = sizes[i] - offset < size ? sizes[i] - offset : size;
+    memcpy(out, (const unsigned char*)parts[i] + offset, n);
+    out += n;
+    size -= n;
+    offset = 0;
+  }
+}
+
+// Deflate the data in INDEX_BLOCK_SIZE blocks, several blocks at a time on
+// all threads, and append them in order. The table of block offsets goes
+// last so the file is written front to back.
+static inline void
+dumpIndexBlock(Index* index, const char* path, int level)
+{
+  FILE* fp = fopen(path, "wb");
+  if (fp == NULL) {
+    error("open file %s failed.", path);
+    exit(1);
+  }
+  IndexHeader header = indexHeader(index, INDEX_FORMAT_BLOCK);
+  if (fwrite(&header, sizeof(IndexHeader), 1, fp) != 1
+      || fwrite(index->names, 1, index->namesSize, fp) != index->namesSize) {
+    error("write index %s failed. %s", path, display_error);
+    exit(1);
+  }
+  const void* parts[2];
+  size_t sizes[2];
+  int nparts = indexData(index, parts, sizes);
+  size_t nblocks = (header.dataSize + INDEX_BLOCK_SIZE - 1) / INDEX_BLOCK_SIZE;
+  uint64_t* table = dmalloc(sizeof(uint64_t) * (nblocks + 1));
+  int nthreads = 1;
+#ifdef ROA_PARALLEL
+  nthreads = omp_get_max_threads();
+#endif
+  size_t round = (size_t)nthreads * 2;
+  size_t bound = compressBound(INDEX_BLOCK_SIZE);
+  unsigned char* out = dmalloc(bound * round);
+  unsigned char* in = dmalloc(INDEX_BLOCK_SIZE * round);
+  uLongf* outSize = dmalloc(sizeof(uLongf) * round);
+  uint64_t offset = header.dataOffset;
+  for (size_t first = 0; first < nblocks; first += round) {
+    size_t n = nblocks - first < round ? nblocks - first : round;
+    int failed = 0;
+#ifdef ROA_PARALLEL
+#pragma omp parallel for schedule(dynamic, 1) reduction(| : failed)
+#endif
+    for (size_t i = 0; i < n; i++) {
+      size_t start = (first + i) * INDEX_BLOCK_SIZE;
+      size_t size = header.dataSize - start < INDEX_BLOCK_SIZE
+                        ? header.dataSize - start
+                        : INDEX_BLOCK_SIZE;
+      copyIndexData(parts, sizes, nparts, start, size,
+                    in + i * INDEX_BLOCK_SIZE);
+      outSize[i] = bound;
+      failed |= compress2(out + i * bound, &outSize[i],
+                          in + i * INDEX_BLOCK_SIZE, size, level)
+                != Z_OK;
+    }
+    if (failed) {
+      error("compress index %s failed.", path);
+      exit(1);
+    }
+    for (size_t i = 0; i < n; i++) {
+      table[first + i] = offset;
+      offset += outSize[i];
+      if (fwrite(out + i * bound, 1, outSize[i], fp) != outSize[i]) {
+        error("write index %s failed. %s", path, display_error);
+        exit(1);
+      }
+    }
+  }
+  table[nblocks] = offset;
+  if (fwrite(table, sizeof(uint64_t), nblocks + 1, fp) != nblocks + 1) {
+    error("write index %s failed. %s", path, display_error);
+    exit(1);
+  }
+  fclose(fp);
+  dfree(outSize, sizeof(uLongf) * round);
+  dfree(in, INDEX_BLOCK_SIZE * round);
+  dfree(out, bound * round);
+  dfree(table, sizeof(uint64_t) * (nblocks + 1));
+}
+
+static inline void
+dumpIndexRaw(Index* index, const char* path)
+{
+  FILE* fp = fopen(path, "wb");
+  if (fp == NULL) {
+    error("open file %s failed.", path);
+    exit(1);
+  }
+  IndexHeader header = indexHeader(index, INDEX_FORMAT_RAW);
+  char pad[INDEX_PAGE_SIZE] = { 0 };
+  size_t padSize = header.dataOffset - INDEX_HEADER_SIZE - index->namesSize;
+  if (fwrite(&header, sizeof(IndexHeader), 1, fp) != 1
+      || fwrite(index->names, 1, index->namesSize, fp) != index->namesSize
+      || fwrite(pad, 1, padSize, fp) != padSize) {
+    error("write index %s failed. %s", path, display_error);
+    exit(1);
+  }
+  const void* parts[2];
+  size_t sizes[2];
+  int nparts = indexData(index, parts, sizes);
+  for (int i = 0; i < nparts; i++) {
+    if (fwrite(parts[i], sizeof(uint8_t), sizes[i], fp) != sizes[i]) {
+      error("write index %s failed. %s", path, display_error);
+      exit(1);
+    }
+  }
+  fclose(fp);
+}
+
+static inline void
+dumpIndex(Index* index, const char* path, IndexFormat format, int level)
+{
+  if (format == INDEX_FORMAT_RAW) {
+    dumpIndexRaw(index, path);
+  } else {
+    dumpIndexBlock(index, path, level);
+  }
+}
+
+static inline void
+checkIndexHeader(IndexHeader* header, const char* path)
+{
+  if (header->version != INDEX_VERSION) {
+    error("index %s has version %u, expected %u.", path, header->version,
+          INDEX_VERSION);
+    exit(1);
+  }
+  if (header->k != KMER_LEN) {
+    error("index %s was built with k = %u, expected %d.", path, header->k,
+          KMER_LEN);
+    exit(1);
+  }
+  // slots are 1, 2, 4 or 8 bits wide, with a bit per membership reference
+  int ok = header->nbit >= 1 && header->nbit <= 8
+           && (header->nbit & (header->nbit - 1)) == 0
+           && header->nref <= header->nbit
+           && header->nref <= INDEX_MAX_REFS && header->canonical <= 1
+           && (header->nref == 0) == (header->namesSize == 0)
+           && header->dataOffset >= INDEX_HEADER_SIZE + header->namesSize;
+  if (header->repr == INDEX_REPR_HASH) {
+    size_t capacity = header->dataSize / sizeof(uint64_t);
+    ok = ok && header->dataSize % sizeof(uint64_t) == 0
+         && capacity >= KMERSET_MIN_CAPACITY
+         && (capacity & (capacity - 1)) == 0 && header->size < capacity;
+  } else if (header->repr == INDEX_REPR_SPARSE) {
+    ok = ok && header->dataSize >= roaringOffsetsBytes()
+         && (header->dataSize - roaringOffsetsBytes()) % sizeof(uint16_t) == 0;
+  } else {
+    ok = ok && header->repr == INDEX_REPR_DENSE
+         && header->size == KMER_MASK + 1
+         && header->dataSize == (header->size * header->nbit + 7) / 8;
+  }
+  if (!ok) {
+    error("index %s is corrupted.", path);
+    exit(1);
+  }
+}
+
+// the names block must hold nref NUL terminated names, indexRefName() walks
+// them without a bound
+static inline void
+checkIndexNames(IndexHeader* header, const char* names, const char* path)
+{
+  size_t n = 0;
+  for (size_t i = 0; i < header->namesSize; i++) {
+    n += names[i] == '\0';
+  }
+  if (header->namesSize
+      && (names[header->namesSize - 1] != '\0' || n != header->nref)) {
+    error("index %s is corrupted.", path);
+    exit(1);
+  }
+}
+
+// set up the index structures on top of data laid out as by indexData()
+static inline void
+attachIndexData(Index* index, IndexHeader* header, unsigned char* data)
+{
+  index->repr = header->repr;
+  index->nref = header->nref;
+  index->canonical = header->canonical;
+  if (header->repr == INDEX_REPR_HASH) {
+    index->hash = dmalloc(sizeof(KmerSet));
+    index->hash->capacity = header->dataSize / sizeof(uint64_t);
+    index->hash->count = header->size;
+    index->hash->slots = (uint64_t*)data;
+    return;
+  }
+  if (header->repr == INDEX_REPR_SPARSE) {
+    index->sparse = dmalloc(sizeof(Roaring));
+    index->sparse->cardinality = header->size;
+    index->sparse->nwords
+        = (header->dataSize - roaringOffsetsBytes()) / sizeof(uint16_t);
+    index->sparse->offsets = (uint32_t*)data;
+    index->sparse->words = (uint16_t*)(data + roaringOffsetsBytes());
+    return;
+  }
+  index->index = dmalloc(sizeof(BitArray));
+  index->index->size = header->size;
+  index->index->nbit = header->nbit;
+  index->index->mask = bitMask[header->nbit - 1];
+  index->index->__realCols = header->dataSize;
+  index->index->data = data;
+}
+
+static inline void
+gzreadAll(gzFile fp, void* buff, size_t size, const char* path)
+{
+  for (size_t off = 0; off < size; off += 1UL << 30) {
+    size_t n = size - off < 1UL << 30 ? size - off : 1UL << 30;
+    if (gzread(fp, (char*)buff + off, n) != (int)n) {
+      error("index %s is truncated.", path);
+      exit(1);
+    }
+  }
 }
 
 static inline Index*
-loadIndex(const char* path)
+loadIndexGzip(const char* path)
 {
-  Index* index = dmalloc(sizeof(Index));
+  Index* index = newIndex(path, INDEX_REPR_DENSE);
+  gzFile fp = gzopen(path, "rb");
+  if (fp == NULL) {
+    error("open file %s failed.", path);
+    exit(1);
+  }
+  IndexHeader header;
+  int n = gzread(fp, &header, sizeof(IndexHeader));
+  if (n == sizeof(IndexHeader)
+      && memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0) {
+    checkIndexHeader(&header, path);
+    if (header.repr == INDEX_REPR_SPARSE) {
+      size_t nwords
+          = (header.dataSize - roaringOffsetsBytes()) / sizeof(uint16_t);
+      index->sparse = roaringAlloc(nwords);
+      index->sparse->cardinality = header.size;
+      gzreadAll(fp, index->sparse->offsets, roaringOffsetsBytes(), path);
+      gzreadAll(fp, index->sparse->words, sizeof(uint16_t) * nwords, path);
+      index->repr = INDEX_REPR_SPARSE;
+      index->canonical = header.canonical;
+    } else {
+      unsigned char* data = dmalloc(header.dataSize);
+      gzreadAll(fp, data, header.dataSize, path);
+      attachIndexData(index, &header, data);
+    }
+    gzclose(fp);
+    return index;
+  }
+  // legacy layout: the BitArray fields followed by its data
+  gzrewind(fp);
   BitArray* b = bitarrayNew(1, 1);
   dfree(b->data, sizeof(uint8_t) * b->__realCols);
   index->index = b;
-  gzFile fp = gzopen(path, "rb");
   gzread(fp, &index->index->size, sizeof(size_t));
   gzread(fp, &index->index->mask, sizeof(char));
   gzread(fp, &index->index->nbit, sizeof(int));
   gzread(fp, &index->index->__realCols, sizeof(size_t));
   index->index->data = dmalloc(sizeof(uint8_t) * index->index->__realCols);
-  gzread(fp, index->index->data, sizeof(uint8_t) * index->index->__realCols);
+  gzreadAll(fp, index->index->data, index->index->__realCols, path);
   gzclose(fp);
   return index;
 }
 
-static inline void
-freeIndex(Index* index)
+// map the data of a raw index read-only; pages are shared through the page
+// cache by every process using the same index file
+static inline Index*
+loadIndexRaw(const char* path)
 {
-  bitarrayFree(index->index);
-  dfree(index, sizeof(Index));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    error("open file %s failed. %s", path, display_error);
+    exit(1);
+  }
+  IndexHeader header;
+  if (pread(fd, &header, sizeof(IndexHeader), 0) != sizeof(IndexHeader)) {
+    error("index %s is truncated.", path);
+    exit(1);
+  }
+  checkIndexHeader(&header, path);
+  struct stat st;
+  fstat(fd, &st);
+  size_t mapSize = header.dataOffset + header.dataSize;
+  if ((size_t)st.st_size < mapSize) {
+    error("index %s is truncated.", path);
+    exit(1);
+  }
+  void* map = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    error("mmap index %s failed. %s", path, display_error);
+    exit(1);
+  }
+  // lookups are uniformly random, read-ahead only wastes IO
+  madvise(map, mapSize, MADV_RANDOM);
+  Index* index = newIndex(path, header.repr);
+  index->map = map;
+  index->mapSize = mapSize;
+  if (header.namesSize) {
+    index->namesSize = header.namesSize;
+    index->names = dmalloc(header.namesSize);
+    memcpy(index->names, (char*)map + INDEX_HEADER_SIZE, header.namesSize);
+    checkIndexNames(&header, index->names, path);
+  }
+  attachIndexData(index, &header, (unsigned char*)map + header.dataOffset);
+  return index;
 }
 
-#ifdef parallel
-#include <omp.h>
+// read the block offset table from the end of the file and inflate every
+// block straight into its place in the data, on all threads
+static inline Index*
+loadIndexBlock(const char* path, FILE* fp, IndexHeader* header)
+{
+  checkIndexHeader(header, path);
+  if (header->blockSize == 0) {
+    error("index %s is corrupted.", path);
+    exit(1);
+  }
+  char* names = NULL;
+  if (header->namesSize) {
+    names = dmalloc(header->namesSize);
+    if (fread(names, 1, header->namesSize, fp) != header->namesSize) {
+      error("index %s is truncated.", path);
+      exit(1);
+    }
+    checkIndexNames(header, names, path);
+  }
+  size_t nblocks
+      = (header->dataSize + header->blockSize - 1) / header->blockSize;
+  size_t tableSize = sizeof(uint64_t) * (nblocks + 1);
+  uint64_t* table = dmalloc(tableSize);
+  if (fseek(fp, -(long)tableSize, SEEK_END) != 0
+      || fread(table, 1, tableSize, fp) != tableSize
+      || table[0] != header->dataOffset || table[nblocks] < table[0]) {
+    error("index %s is truncated.", path);
+    exit(1);
+  }
+  size_t packedSize = table[nblocks] - table[0];
+  unsigned char* packed = dmalloc(packedSize + 1);
+  fseek(fp, header->dataOffset, SEEK_SET);
+  if (fread(packed, 1, packedSize, fp) != packedSize) {
+    error("index %s is truncated.", path);
+    exit(1);
+  }
+  unsigned char* data = dmalloc(header->dataSize);
+  int failed = 0;
+#ifdef ROA_PARALLEL
+#pragma omp parallel for schedule(dynamic, 1) reduction(| : failed)
 #endif
+  for (size_t i = 0; i < nblocks; i++) {
+    size_t start = i * header->blockSize;
+    uLongf size = header->dataSize - start < header->blockSize
+                      ? header->dataSize - start
+                      : header->blockSize;
+    uLongf expect = size;
+    failed |= uncompress(data + start, &size, packed + table[i] - table[0],
+                         table[i + 1] - table[i])
+                  != Z_OK
+              || size != expect;
+  }
+  dfree(packed, packedSize + 1);
+  dfree(table, tableSize);
+  if (failed) {
+    error("index %s is corrupted.", path);
+    exit(1);
+  }
+  Index* index = newIndex(path, header->repr);
+  index->names = names;
+  index->namesSize = header->namesSize;
+  index->nref = header->nref;
+  index->canonical = header->canonical;
+  if (header->repr == INDEX_REPR_SPARSE) {
+    size_t nwords
+        = (header->dataSize - roaringOffsetsBytes()) / sizeof(uint16_t);
+    index->sparse = roaringAlloc(nwords);
+    index->sparse->cardinality = header->size;
+    memcpy(index->sparse->offsets, data, roaringOffsetsBytes());
+    memcpy(index->sparse->words, data + roaringOffsetsBytes(),
+           sizeof(uint16_t) * nwords);
+    dfree(data, header->dataSize);
+  } else {
+    attachIndexData(index, header, data);
+  }
+  return index;
+}
 
-static inline Query*
-createQuery(const char* path, Index* index)
+static inline Index*
+loadIndex(const char* path)
 {
-  uint32_t kmer = 0x00000000;
-  uint32_t reverse_kmer = 0x00000000;
-  unsigned char basemap[128] = { 4 };
-  create_base2int(basemap);
-  char c = 4;
-  Query* query = dmalloc(sizeof(Query));
-  query->kmers = arrayNew(10);
-  query->seqs = arrayNew(10);
-  Seq* seq = NULL;
-  {
-    iter_fasta(path, seq)
-    {
-      // create 16 mer
-      int count = 0;
-      // backup seq
-      Seq* copy_seq = dmalloc(sizeof(Seq));
-      copy_seq->name = dmalloc(sizeof(char) * (strlen(seq->name) + 1));
-      strcpy(copy_seq->name, seq->name);
-      copy_seq->name[strlen(seq->name)] = '\0';
-      copy_seq->len = seq->len;
-      copy_seq->cap = seq->len;
-      copy_seq->seq = dmalloc(sizeof(char) * (seq->len + 1));
-      copy_seq->qual = NULL;
-      strcpy(copy_seq->seq, seq->seq);
-      copy_seq->seq[seq->len] = '\0';
-      arrayPush(query->seqs, copy_seq);
-      Array* kmers = arrayNew(10);
-      if (seq->len < KMER_LEN) {
-        continue;
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    error("open file %s failed. %s", path, display_error);
+    exit(1);
+  }
+  IndexHeader header;
+  size_t n = fread(&header, 1, sizeof(IndexHeader), fp);
+  int headed = n == sizeof(IndexHeader)
+               && memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0;
+  Index* index;
+  if (headed && header.format == INDEX_FORMAT_BLOCK) {
+    index = loadIndexBlock(path, fp, &header);
+    fclose(fp);
+  } else {
+    fclose(fp);
+    index = headed ? loadIndexRaw(path) : loadIndexGzip(path);
+  }
+  // lookups index the words by the container offsets unchecked
+  if (index->repr == INDEX_REPR_SPARSE && !roaringValid(index->sparse)) {
+    error("index %s is corrupted.", path);
+    exit(1);
+  }
+  return index;
+}
+
+// Move the index data into anonymous memory placed by policy (huge pages,
+// NUMA interleaving or one copy per node) and return the placed index, which
+// replaces index. Placed indexes are read only, like mapped ones.
+static inline Index*
+placeIndex(Index* index, MemPolicy* policy)
+{
+  if (policy->pages == MEM_PAGES_NORMAL && policy->numa == MEM_NUMA_LOCAL) {
+    return index;
+  }
+  IndexHeader header = indexHeader(index, INDEX_FORMAT_RAW);
+  const void* parts[2];
+  size_t sizes[2];
+  int nparts = indexData(index, parts, sizes);
+  int ncopy = policy->numa == MEM_NUMA_REPLICATE ? memNodes() : 1;
+  Index** copies = dmalloc(sizeof(Index*) * ncopy);
+  size_t nblock = (header.dataSize + INDEX_BLOCK_SIZE - 1) / INDEX_BLOCK_SIZE;
+  for (int n = 0; n < ncopy; n++) {
+    size_t mapSize = 0;
+    unsigned char* data = memMap(header.dataSize, policy, n, &mapSize);
+#ifdef ROA_PARALLEL
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (size_t b = 0; b < nblock; b++) {
+      size_t offset = b * INDEX_BLOCK_SIZE;
+      size_t size = header.dataSize - offset < INDEX_BLOCK_SIZE
+                        ? header.dataSize - offset
+                        : INDEX_BLOCK_SIZE;
+      copyIndexData(parts, sizes, nparts, offset, size, data + offset);
+    }
+    Index* copy = newIndex(index->path, index->repr);
+    copy->map = data;
+    copy->mapSize = mapSize;
+    attachIndexData(copy, &header, data);
+    copy->mask = index->mask;
+    copies[n] = copy;
+  }
+  Index* placed = copies[0];
+  placed->names = index->names;
+  placed->namesSize = index->namesSize;
+  index->names = NULL;
+  index->namesSize = 0;
+  if (ncopy > 1) {
+    placed->replicas = copies;
+    placed->nreplica = ncopy;
+  } else {
+    dfree(copies, sizeof(Index*) * ncopy);
+  }
+  freeIndex(index);
+  info("index placed on %s pages, numa %s (%d node%s)",
+       memPagesName(policy->pages), memNumaName(policy->numa), memNodes(),
+       memNodes() > 1 ? "s" : "");
+  return placed;
+}
+
+// copy mapped data into owned memory so the index can be modified
+static inline void
+detachIndex(Index* index)
+{
+  if (index->map == NULL) {
+    return;
+  }
+  if (index->repr == INDEX_REPR_SPARSE) {
+    Roaring* r = roaringAlloc(index->sparse->nwords);
+    r->cardinality = index->sparse->cardinality;
+    memcpy(r->offsets, index->sparse->offsets, roaringOffsetsBytes());
+    memcpy(r->words, index->sparse->words,
+           sizeof(uint16_t) * index->sparse->nwords);
+    dfree(index->sparse, sizeof(Roaring));
+    index->sparse = r;
+  } else if (index->repr == INDEX_REPR_HASH) {
+    uint64_t* slots = dmalloc(sizeof(uint64_t) * index->hash->capacity);
+    memcpy(slots, index->hash->slots,
+           sizeof(uint64_t) * index->hash->capacity);
+    index->hash->slots = slots;
+  } else {
+    unsigned char* data = dmalloc(sizeof(uint8_t) * index->index->__realCols);
+    memcpy(data, index->index->data, index->index->__realCols);
+    index->index->data = data;
+  }
+  munmap(index->map, index->mapSize);
+  index->map = NULL;
+  index->mapSize = 0;
+}
+
+// switch an owned index to another representation
+static inline void
+convertIndex(Index* index, IndexRepr repr)
+{
+  if (index->repr == repr) {
+    return;
+  }
+  detachIndex(index);
+  if (repr == INDEX_REPR_HASH) {
+    KmerSet* set = kmersetNew(0);
+    if (index->repr == INDEX_REPR_SPARSE) {
+      kmersetReserve(set, index->sparse->cardinality);
+      roaringForeach(index->sparse, key, kmersetInsert(set, key));
+      roaringFree(index->sparse);
+      index->sparse = NULL;
+    } else {
+      BitArray* bits = index->index;
+      size_t count = 0;
+      for (size_t i = 0; i < bits->__realCols; i++) {
+        count += __builtin_popcount(bits->data[i]);
       }
-      for (size_t i = 0; i < seq->len - KMER_LEN + 1; i++) {
-        c = basemap[seq->seq[i]];
-        if (c == 4) {
-          kmer = 0x00000000;
-          reverse_kmer = 0x00000000;
-          count = 0;
-          continue;
+      kmersetReserve(set, count);
+      for (size_t i = 0; i < bits->__realCols; i++) {
+        unsigned char byte = bits->data[i];
+        while (byte) {
+          kmersetInsert(set, i * 8 + __builtin_ctz(byte));
+          byte &= byte - 1;
         }
-        kmer = (kmer << 2) | (c & 0x3) & KMER_MASK;
-        reverse_kmer =
-            (reverse_kmer >> 2) | ((0x00000003 - c) << 30) & KMER_MASK;
-        count++;
-        if (count < KMER_LEN) {
-          continue;
+      }
+      bitarrayFree(bits);
+      index->index = NULL;
+    }
+    index->hash = set;
+    index->repr = repr;
+    return;
+  }
+  if (index->repr == INDEX_REPR_HASH) {
+    if (!KMER_DIRECT) {
+      error("k = %d is too long for a direct-address index, use -repr hash.",
+            KMER_LEN);
+      exit(1);
+    }
+    BitArray* bits = bitarrayNew(KMER_MASK + 1, 1);
+    kmersetForeach(index->hash, key, bits->data[key >> 3] |= 1 << (key & 7));
+    kmersetFree(index->hash);
+    index->hash = NULL;
+    index->index = bits;
+    index->repr = INDEX_REPR_DENSE;
+    if (repr == INDEX_REPR_DENSE) {
+      return;
+    }
+  }
+  if (repr == INDEX_REPR_DENSE) {
+    BitArray* bits = bitarrayNew(KMER_MASK + 1, 1);
+    roaringForeach(index->sparse, key, bits->data[key >> 3] |= 1 << (key & 7));
+    roaringFree(index->sparse);
+    index->sparse = NULL;
+    index->index = bits;
+  } else {
+    BitArray* bits = index->index;
+    size_t cap = 1UL << 20;
+    size_t n = 0;
+    uint32_t* keys = dmalloc(sizeof(uint32_t) * cap);
+    for (size_t i = 0; i < bits->__realCols; i++) {
+      unsigned char byte = bits->data[i];
+      while (byte) {
+        if (n == cap) {
+          keys = drealloc(keys, sizeof(uint32_t) * cap,
+                          sizeof(uint32_t) * cap * 2);
+          cap *= 2;
         }
-        Kmer* kmer_t = dmalloc(sizeof(Kmer));
-        kmer_t->kmer = kmer;
-        kmer_t->reverse_kmer = reverse_kmer;
-        kmer_t->pos = i - KMER_LEN + 1;
-        kmer_t->drop = 0;
-        kmer_t->strand = 0;
-        arrayPush(kmers, kmer_t);
+        keys[n++] = (uint32_t)(i * 8 + __builtin_ctz(byte));
+        byte &= byte - 1;
       }
-      arrayPush(query->kmers, kmers);
     }
+    index->sparse = roaringFromKeys(keys, n);
+    dfree(keys, sizeof(uint32_t) * cap);
+    bitarrayFree(bits);
+    index->index = NULL;
+  }
+  index->repr = repr;
+}
+
+// OR src into dst and release src; dst may be NULL
+static inline Index*
+mergeIndex(Index* dst, Index* src)
+{
+  detachIndex(src);
+  if (dst == NULL) {
+    return src;
+  }
+  if (dst->canonical != src->canonical) {
+    error("index %s is %s but the others are %s, rebuild it to match.",
+          src->path, src->canonical ? "canonical" : "plain",
+          dst->canonical ? "canonical" : "plain");
+    exit(1);
+  }
+  if (dst->repr == INDEX_REPR_HASH || src->repr == INDEX_REPR_HASH) {
+    convertIndex(dst, INDEX_REPR_HASH);
+    convertIndex(src, INDEX_REPR_HASH);
+    kmersetReserve(dst->hash, dst->hash->count + src->hash->count);
+    kmersetForeach(src->hash, key, kmersetInsert(dst->hash, key));
+  } else if (dst->repr == INDEX_REPR_SPARSE
+             && src->repr == INDEX_REPR_SPARSE) {
+    Roaring* merged = roaringUnion(dst->sparse, src->sparse);
+    roaringFree(dst->sparse);
+    dst->sparse = merged;
+  } else {
+    convertIndex(dst, INDEX_REPR_DENSE);
+    if (src->repr == INDEX_REPR_SPARSE) {
+      BitArray* bits = dst->index;
+      roaringForeach(src->sparse, key,
+                     bits->data[key >> 3] |= 1 << (key & 7));
+    } else {
+      bitarrayOr(dst->index, src->index);
+    }
+  }
+  freeIndex(src);
+  return dst;
+}
+
+// whether the first word of a record name is in the comma separated list
+static inline int
+queryNameListed(const char* names, const char* name, size_t len)
+{
+  size_t word = strcspn(name, " \t");
+  len = word < len ? word : len;
+  const char* item = names;
+  while (*item) {
+    size_t n = strcspn(item, ",");
+    if (n == len && strncmp(item, name, len) == 0) {
+      return 1;
+    }
+    item += n;
+    if (*item == ',') {
+      item++;
+    }
+  }
+  return 0;
+}
+
+// Copy the records of a plain, indexed query file, or only the listed
+// ones, straight out of the mapping. Record sizes are known up front, so
+// the batch is laid out first and the records are fetched in parallel.
+static inline void
+loadQueryIndexed(Query* query, Faidx* fai, const char* names)
+{
+  IdVec* ids = IdVecNew(fai->size);
+  for (size_t i = 0; i < fai->size; i++) {
+    const char* name = fai->records[i].name;
+    if (names == NULL || queryNameListed(names, name, strlen(name))) {
+      IdVecPush(ids, i);
+    }
+  }
+  for (size_t i = 0; i < ids->size; i++) {
+    size_t id = ids->data[i];
+    size_t name_len;
+    faiHeader(fai, id, &name_len);
+    seq_batch_add(query->batch, name_len, fai->records[id].length);
+  }
+#ifdef ROA_PARALLEL
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (size_t i = 0; i < ids->size; i++) {
+    size_t id = ids->data[i];
+    Seq* seq = query->batch->seqs + i;
+    size_t name_len;
+    const char* name = faiHeader(fai, id, &name_len);
+    memcpy(seq->name, name, name_len);
+    seq->len = faiFetch(fai, id, 0, seq->len, seq->seq);
+    seq->seq[seq->len] = '\0';
+  }
+  IdVecFree(ids);
+}
+
+static inline void
+loadQuerySequential(Query* query, const char* path, const char* names)
+{
+  SeqReader* reader = seq_reader_open(path);
+  if (names == NULL) {
+    seq_reader_read(reader, query->batch, 0, 0);
+  } else {
+    SeqBatch* batch = seq_batch_new();
+    while (seq_reader_read(reader, batch, 0, INDEX_BATCH_LEN)) {
+      for (size_t i = 0; i < batch->size; i++) {
+        Seq* seq = batch->seqs + i;
+        if (queryNameListed(names, seq->name, strlen(seq->name))) {
+          seq_batch_push(query->batch, seq);
+        }
+      }
+    }
+    seq_batch_free(batch);
+  }
+  seq_reader_close(reader);
+}
+
+// every listed name must have matched a record
+static inline void
+checkQueryNames(Query* query, const char* names)
+{
+  const char* item = names;
+  while (*item) {
+    size_t len = strcspn(item, ",");
+    int found = 0;
+    for (size_t i = 0; i < query->batch->size && !found; i++) {
+      Seq* seq = query->batch->seqs + i;
+      found = strcspn(seq->name, " \t") == len
+              && strncmp(seq->name, item, len) == 0;
+    }
+    if (!found) {
+      error("query %.*s is not in the query file.", (int)len, item);
+      exit(1);
+    }
+    item += len;
+    if (*item == ',') {
+      item++;
+    }
+  }
+}
+
+static inline int
+kmerTableDropped(KmerTable* table, size_t slot)
+{
+  return (table->drop[slot / 64] >> (slot & 63)) & 1;
+}
+
+// drop slots [from, to); the words may be shared with other threads
+static inline void
+kmerTableDropRange(KmerTable* table, size_t from, size_t to)
+{
+  for (size_t slot = from; slot < to; slot++) {
+    __atomic_fetch_or(table->drop + slot / 64, 1ULL << (slot & 63),
+                      __ATOMIC_RELAXED);
+  }
+}
+
+// slots [from, to) of the record starting at slot base hold no kmer, e.g.
+// they cover an N; clear and drop them
+static inline void
+kmerTableSkip(KmerTable* table, size_t base, size_t from, size_t to)
+{
+  for (size_t slot = from; slot < to; slot++) {
+    table->fwd[base + slot] = 0;
+    table->rev[base + slot] = 0;
+    table->pos[base + slot] = slot;
+  }
+  kmerTableDropRange(table, base + from, base + to);
+}
+
+// one slot per kmer start of every record, sized from the record lengths;
+// as in the index, kmers never end in the last KMER_LEN - 1 bases
+static inline KmerTable*
+kmerTableNew(SeqBatch* batch)
+{
+  KmerTable* table = dmalloc(sizeof(KmerTable));
+  table->nrecords = batch->size;
+  table->offsets = dmalloc(sizeof(size_t) * (batch->size + 1));
+  size_t size = 0;
+  for (size_t i = 0; i < batch->size; i++) {
+    size_t len = batch->seqs[i].len;
+    table->offsets[i] = size;
+    size += len >= 2 * KMER_LEN - 1 ? len - 2 * KMER_LEN + 2 : 0;
+  }
+  table->offsets[batch->size] = size;
+  table->size = size;
+  table->fwd = dmalloc(sizeof(kmer_t) * (size ? size : 1));
+  table->rev = dmalloc(sizeof(kmer_t) * (size ? size : 1));
+  table->pos = dmalloc(sizeof(uint32_t) * (size ? size : 1));
+  table->drop = dcalloc(packMaskWords(size) + 1, sizeof(uint64_t));
+  return table;
+}
+
+static inline void
+kmerTableFree(KmerTable* table)
+{
+  size_t size = table->size ? table->size : 1;
+  dfree(table->offsets, sizeof(size_t) * (table->nrecords + 1));
+  dfree(table->fwd, sizeof(kmer_t) * size);
+  dfree(table->rev, sizeof(kmer_t) * size);
+  dfree(table->pos, sizeof(uint32_t) * size);
+  dfree(table->drop, sizeof(uint64_t) * (packMaskWords(table->size) + 1));
+  dfree(table, sizeof(KmerTable));
+}
+
+// Read the query records, all of them or the ones named in the comma
+// separated names, and extract their kmers one record per thread. Plain
+// files go through their .fai index, built on the fly when there is none.
+static inline Query*
+createQuery(const char* path, const char* names)
+{
+  Query* query = dmalloc(sizeof(Query));
+  query->tag = memTag();
+  query->batch = seq_batch_new();
+  Faidx* fai = faiOpen(path);
+  if (fai) {
+    loadQueryIndexed(query, fai, names);
+    faiFree(fai);
+  } else {
+    loadQuerySequential(query, path, names);
+  }
+  if (names) {
+    checkQueryNames(query, names);
+  }
+  KmerTable* table = kmerTableNew(query->batch);
+  query->kmers = table;
+#ifdef ROA_PARALLEL
+  int nthreads = omp_get_max_threads();
+#else
+  int nthreads = 1;
+#endif
+  Packed** packs = dmalloc(sizeof(Packed*) * nthreads);
+  for (int t = 0; t < nthreads; t++) {
+    packs[t] = packedNew(1UL << 16);
+  }
+#ifdef ROA_PARALLEL
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (size_t i = 0; i < query->batch->size; i++) {
+#ifdef ROA_PARALLEL
+    Packed* packed = packs[omp_get_thread_num()];
+#else
+    Packed* packed = packs[0];
+#endif
+    Seq* seq = query->batch->seqs + i;
+    size_t base = table->offsets[i];
+    size_t nslot = table->offsets[i + 1] - base;
+    if (nslot == 0) {
+      continue;
+    }
+    size_t n = seq->len - KMER_LEN + 1;
+    packedReserve(packed, n);
+    packBases(packed, seq->seq, n);
+    // slots of kmers over an N are never emitted
+    size_t next = 0;
+    packForeachKmer(packed, KMER_LEN, fwd, rev, pos, {
+      size_t start = pos - KMER_LEN + 1;
+      if (start > next) {
+        kmerTableSkip(table, base, next, start);
+      }
+      table->fwd[base + start] = fwd;
+      table->rev[base + start] = rev;
+      table->pos[base + start] = start;
+      next = start + 1;
+    });
+    kmerTableSkip(table, base, next, nslot);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    packedFree(packs[t]);
   }
+  dfree(packs, sizeof(Packed*) * nthreads);
   return query;
 }
 
 static inline void
 freeQuery(Query* query)
 {
-  for (size_t i = 0; i < query->kmers->size; i++) {
-    Array* kmers = arrayGet(query->kmers, i);
-    for (size_t j = 0; j < kmers->size; j++) {
-      dfree(kmers->data[j], sizeof(Kmer));
-    }
-    arrayFree(kmers);
-  }
-  arrayFree(query->kmers);
-  for (size_t i = 0; i < query->seqs->size; i++) {
-    free_seq(query->seqs->data[i]);
-  }
-  arrayFree(query->seqs);
+  int old = memSetThreadTag(query->tag);
+  kmerTableFree(query->kmers);
+  seq_batch_free(query->batch);
   dfree(query, sizeof(Query));
+  memSetThreadTag(old);
 }
 
+// drop the runs of kept slots shorter than 4 in slots [begin, end)
 static inline void
-vaildKmers(Query* query, Index* index)
+dropShortRuns(KmerTable* table, size_t begin, size_t end)
 {
-  for (size_t i = 0; i < query->kmers->size; i++) {
-    Array* kmers = query->kmers->data[i];
-#ifdef parallel
-    size_t t = 0;
-    size_t start = 0;
-    size_t end = kmers->size;
-#pragma omp parallel private(start, end, t)
-    t = omp_get_thread_num();
-    start = (kmers->size / omp_get_num_threads()) * t;
-    end = (kmers->size / omp_get_num_threads()) * (t + 1);
-    if (omp_get_thread_num() == omp_get_num_threads() - 1) {
-      end = kmers->size;
+  size_t run = begin;
+  for (size_t slot = begin; slot <= end; slot++) {
+    if (slot < end && !kmerTableDropped(table, slot)) {
+      continue;
     }
-#else
-    size_t start = 0;
-    size_t end = kmers->size;
-#endif
-    for (size_t j = start; j < end; j++) {
-      Kmer* kmer = kmers->data[j];
-      if (kmer->drop == 1) {
-        continue;
-      }
-      if (bitarrayGet(index->index, kmer->kmer)) {
-        kmer->drop = 1;
-        continue;
-      }
-      if (bitarrayGet(index->index, kmer->reverse_kmer)) {
-        kmer->drop = 1;
-        continue;
+    if (slot - run < 4) {
+      for (size_t j = run; j < slot; j++) {
+        table->drop[j / 64] |= 1ULL << (j & 63);
       }
     }
-    // set not continuous kmer to drop
-    size_t window_start = 0;
-    size_t window_end = 0;
-    int prev_status = -1;
-    for (size_t i = 0; i < kmers->size; i++) {
-      Kmer* kmer = kmers->data[i];
-      if (prev_status == -1) {
-        if (kmer->drop == 1) {
+    run = slot + 1;
+  }
+}
+
+static inline void
+vaildKmers(Query* query, Index* index)
+{
+  KmerTable* table = query->kmers;
+  // look kmers up a drop word at a time, in batches so hashed probes can
+  // overlap; every word has a single writer
+#ifdef ROA_PARALLEL
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+  for (size_t w = 0; w < packMaskWords(table->size); w++) {
+    size_t first = w * 64;
+    size_t last = first + 64 < table->size ? first + 64 : table->size;
+    uint64_t drop = table->drop[w];
+    for (size_t start = first; start < last; start += INDEX_LOOKUP_BATCH) {
+      size_t end = start + INDEX_LOOKUP_BATCH < last
+                       ? start + INDEX_LOOKUP_BATCH
+                       : last;
+      kmer_t keys[INDEX_LOOKUP_BATCH];
+      unsigned char hit[INDEX_LOOKUP_BATCH];
+      // slot of every key; dropped slots hold no kmer and are not probed
+      size_t at[INDEX_LOOKUP_BATCH];
+      size_t n = 0;
+      for (size_t j = start; j < end; j++) {
+        if ((drop >> (j - first)) & 1) {
           continue;
         }
-        prev_status = kmer->drop;
-        window_start = i;
-        continue;
+        at[n] = j;
+        keys[n++] = index->canonical
+                        ? canonicalKmer(table->fwd[j], table->rev[j])
+                        : table->fwd[j];
       }
-      if (prev_status != kmer->drop) {
-        window_end = i;
-        if (window_end - window_start < 4) {
-          for (size_t j = window_start; j < window_end; j++) {
-            ((Kmer*)kmers->data[j])->drop = 1;
-          }
+      indexHasBatch(index, keys, n, hit);
+      if (!index->canonical) {
+        // a plain index needs a second probe for the other strand
+        for (size_t k = 0; k < n; k++) {
+          keys[k] = table->rev[at[k]];
+          drop |= (uint64_t)hit[k] << (at[k] - first);
         }
-        window_start = i;
-        prev_status = kmer->drop;
-        continue;
+        indexHasBatch(index, keys, n, hit);
       }
-    }
-    if (prev_status != -1) {
-      window_end = kmers->size;
-      if (window_end - window_start < 4) {
-        for (size_t j = window_start; j < window_end; j++) {
-          ((Kmer*)kmers->data[j])->drop = 1;
-        }
+      for (size_t k = 0; k < n; k++) {
+        drop |= (uint64_t)hit[k] << (at[k] - first);
       }
     }
+    table->drop[w] = drop;
+  }
+  // set not continuous kmer to drop
+  for (size_t i = 0; i < table->nrecords; i++) {
+    dropShortRuns(table, table->offsets[i], table->offsets[i + 1]);
   }
 }
 
 #define collectSegmentMacro(segments, start, end)                             \
   do {                                                                        \
-    Segment* segment = dmalloc(sizeof(Segment));                              \
-    segment->start = start;                                                   \
-    segment->end = end;                                                       \
-    segment->bases = bitarrayNew(end - start + KMER_LEN + 1, 2);              \
-    segment->name = ((Seq*)query->seqs->data[i])->name;                       \
+    Segment* segment = SegmentVecEmplace(segments);                           \
+    segment->start = table->pos[start];                                       \
+    segment->end = table->pos[end];                                           \
+    segment->kmer = 0;                                                        \
+    /* the bases stay in the query table, which outlives the segment */       \
+    segment->kmers = table->fwd + start;                                      \
+    segment->len = end - start + KMER_LEN;                                    \
+    segment->name = query->batch->seqs[i].name;                               \
     segment->vaild = 1;                                                       \
-    {                                                                         \
-      Kmer* kmer = kmers->data[start];                                        \
-      uint32_t kmerint = kmer->kmer;                                          \
-      for (size_t k = 0; k < KMER_LEN; k++) {                                 \
-        bitarraySet(segment->bases, KMER_LEN - k - 1, kmerint & 0x3);         \
-        kmerint >>= 2;                                                        \
-      }                                                                       \
-      for (size_t k = start + 1; k <= end; k++) {                             \
-        kmer = kmers->data[k];                                                \
-        bitarraySet(segment->bases, KMER_LEN + k - 1, kmer->kmer & 0x3);      \
-      }                                                                       \
-    }                                                                         \
-    arrayPush(segments, segment);                                             \
   } while (0)
 
-static inline Array*
+static inline SegmentVec*
 collectSegment(Query* query)
 {
-  Array* segments = arrayNew(10);
-  for (size_t i = 0; i < query->kmers->size; i++) {
-    Array* kmers = query->kmers->data[i];
-    long int start = -1;
-    long int end = -1;
-    for (size_t j = 0; j < kmers->size; j++) {
-      Kmer* kmer = kmers->data[j];
-      // collect all continuous kmers that not drop
-      // and represent a segment
-      if (kmer->drop == 1) {
-        if (start != -1) {
-          if (end - start > 5) {
-            collectSegmentMacro(segments, start, end);
-          }
-          start = -1;
-          end = -1;
-        }
+  KmerTable* table = query->kmers;
+  SegmentVec* segments = SegmentVecNew(16);
+  for (size_t i = 0; i < table->nrecords; i++) {
+    // collect all continuous kmers that not drop
+    // and represent a segment
+    size_t start = table->offsets[i];
+    for (size_t slot = start; slot <= table->offsets[i + 1]; slot++) {
+      if (slot < table->offsets[i + 1] && !kmerTableDropped(table, slot)) {
         continue;
       }
-      if (start == -1) {
-        start = kmer->pos;
-      }
-      end = kmer->pos;
-    }
-    // collect the last segment
-    if (start != -1 && end != -1 && ((Kmer*)kmers->data[start])->drop == 0) {
-      if (end - start > 5) {
+      size_t end = slot - 1;
+      if (slot > start && end - start > 5) {
         collectSegmentMacro(segments, start, end);
       }
+      start = slot + 1;
     }
   }
   debug("collect %zu segments", segments->size);
@@ -404,30 +1794,31 @@ typedef struct {
   int ncircle;
 } FilterOpts;
 
-static inline Array*
-filterSegment(Array* segments, FilterOpts* opts)
+static inline SegmentVec*
+filterSegment(SegmentVec* segments, FilterOpts* opts)
 {
-  Array* result = arrayNew(10);
-  unsigned char bases[KMER_LONG_LEN] = { 4 };
-#ifdef parallel
+  // every segment collects its probes on its own, so they keep the serial
+  // order whatever the number of threads
+  SegmentVec* found = dmalloc(sizeof(SegmentVec) * (segments->size + 1));
+  const uint64_t mask = KMER_LONG_MASK;
+#ifdef ROA_PARALLEL
 #pragma omp parallel for
 #endif
   for (size_t i = 0; i < segments->size; i++) {
-    Segment* s = segments->data[i];
-    debug("filter segment %zu", s->bases->size);
-    size_t j = 0;
-    size_t je = s->bases->size - KMER_LONG_LEN + 1;
-    if (s->bases->size < KMER_LONG_LEN * 2) {
+    Segment* s = segments->data + i;
+    SegmentVecInit(found + i);
+    debug("filter segment %zu", s->len);
+    if (s->len < KMER_LONG_LEN * 2) {
       continue;
     }
-    for (; j < je; j++) {
-      int gc = 0;
-      for (size_t z = 0; z < KMER_LONG_LEN; z++) {
-        bases[z] = bitarrayGet(s->bases, z + j);
-        if (int2base[bases[z]] == 'G' || int2base[bases[z]] == 'C') {
-          gc++;
-        }
-      }
+    // roll a KMER_LONG_LEN window over the segment, first base high
+    uint64_t probe = 0;
+    for (size_t z = 0; z < KMER_LONG_LEN - 1; z++) {
+      probe = (probe << 2) | segmentBase(s, z);
+    }
+    for (size_t j = 0; j + KMER_LONG_LEN <= s->len; j++) {
+      probe = ((probe << 2) | segmentBase(s, j + KMER_LONG_LEN - 1)) & mask;
+      int gc = packGC(probe);
       if (GC_RATE[gc] < opts->minGC || GC_RATE[gc] > opts->maxGC) {
         continue;
       }
@@ -441,31 +1832,25 @@ filterSegment(Array* segments, FilterOpts* opts)
       }
 
       // avoid CG in 3' end more than 3 times
-      if (opts->avoidCGIn3) {
-        int cg = 0;
-        for (int i = 0; i < 3; i++) {
-          if (int2base[bases[i]] == 'G' || int2base[bases[i]] == 'C') {
-            cg++;
-          }
-        }
-        if (cg == 3) {
-          continue;
-        }
+      if (opts->avoidCGIn3
+          && packGC(probe >> (2 * (KMER_LONG_LEN - 3))) == 3) {
+        continue;
       }
       // avoid T in 3' end
       if (opts->avoidTIn3) {
-        char left = int2base[bases[0]];
-        char right = int2base[bases[KMER_LONG_LEN - 1]];
-        if (left == 'T' || right == 'T' || left == 'A' || right == 'A') {
+        int left = probe >> (2 * (KMER_LONG_LEN - 1));
+        int right = probe & 3;
+        // T3 or A0 at either end
+        if (left == 3 || right == 3 || left == 0 || right == 0) {
           continue;
         }
       }
       // homopolymer
-      char prevc = bases[0];
+      int prevc = probe >> (2 * (KMER_LONG_LEN - 1));
       int maxHome = 1;
       int isHome = 0;
-      for (int i = 1; i < KMER_LONG_LEN; i++) {
-        char c = bases[i];
+      for (int z = 1; z < KMER_LONG_LEN; z++) {
+        int c = (probe >> (2 * (KMER_LONG_LEN - 1 - z))) & 3;
         if (c == prevc) {
           maxHome++;
         } else {
@@ -480,189 +1865,225 @@ filterSegment(Array* segments, FilterOpts* opts)
       if (isHome) {
         continue;
       }
-      Segment* segment = dmalloc(sizeof(Segment));
-      segment->start = s->start + j;
-      segment->end = s->start + j + KMER_LONG_LEN - 1;
-      segment->bases = bitarrayNew(KMER_LONG_LEN, 2);
-      segment->name = s->name;
-      segment->vaild = 1;
-      segment->Tm = tm;
-      for (size_t k = 0; k < KMER_LONG_LEN; k++) {
-        bitarraySet(segment->bases, k, bases[k]);
-      }
-#ifdef parallel
-#pragma omp critical
-#endif
-      // set id
-      segment->id = result->size;
-      arrayPush(result, segment);
+      Segment segment = { .start = s->start + j,
+                          .end = s->start + j + KMER_LONG_LEN - 1,
+                          .kmer = probe,
+                          .kmers = NULL,
+                          .len = KMER_LONG_LEN,
+                          .name = s->name,
+                          .vaild = 1,
+                          .Tm = tm };
+      SegmentVecPush(found + i, segment);
     }
   }
+  SegmentVec* result = SegmentVecNew(16);
+  for (size_t i = 0; i < segments->size; i++) {
+    SegmentVecAppend(result, found[i].data, found[i].size);
+    SegmentVecRelease(found + i);
+  }
+  dfree(found, sizeof(SegmentVec) * (segments->size + 1));
+  // set id
+  for (size_t i = 0; i < result->size; i++) {
+    result->data[i].id = i;
+  }
   return result;
 }
 
 int
 cmpSegments(const void* a, const void* b)
 {
-  Segment* sa = *(Segment**)a;
-  Segment* sb = *(Segment**)b;
+  const Segment* sa = a;
+  const Segment* sb = b;
   return sb->vaild - sa->vaild;
 }
 
-static inline Array*
-pairJoinCheck(Array* segments, Index* index)
+// Row i of the pair matrix has bit j set if segment i may be followed by
+// segment j. The rows live in the matrix arena and go away with it.
+typedef struct {
+  BitArray** rows;
+  size_t size;
+  Arena* arena;
+} PairMatrix;
+
+static inline PairMatrix*
+pairMatrixNew(size_t size)
+{
+  PairMatrix* pair = dmalloc(sizeof(PairMatrix));
+  pair->size = size;
+  pair->arena = arenaNew(1UL << 20);
+  pair->rows = arenaAlloc(pair->arena, sizeof(BitArray*) * size);
+  for (size_t i = 0; i < size; i++) {
+    BitArray* row = arenaAlloc(pair->arena, sizeof(BitArray));
+    row->size = size;
+    row->nbit = 1;
+    row->mask = bitMask[0];
+    row->__realCols = (size + 7) / 8;
+    row->data = arenaCalloc(pair->arena, row->__realCols, 1);
+    pair->rows[i] = row;
+  }
+  return pair;
+}
+
+static inline PairMatrix*
+pairJoinCheck(SegmentVec* segments, Index* index)
 {
-  Array* pair = arrayNew(segments->size);
-  // connect every two segments and check if the connection is vaild
-  // if vaild, then join the two segments, insert the pair into the pair array
-  // connect
-#ifdef parallel
+  PairMatrix* pair = pairMatrixNew(segments->size);
+  // Connect every two segments and check if the connection is vaild: the
+  // junction, bases 1.. of s1 followed by bases ..KMER_LONG_LEN - 2 of s2,
+  // must have no kmer in the index. It fits in 128 bits, so every kmer and
+  // its reverse complement are shifted out of two registers.
+  const int width = 2 * (KMER_LONG_LEN - 1); // bits of either half
+  const int njunction = 2 * (KMER_LONG_LEN - 1) - KMER_LEN + 1;
+  const uint64_t half = (1ULL << width) - 1;
+#ifdef ROA_PARALLEL
 #pragma omp parallel for
 #endif
   for (size_t i = 0; i < segments->size; i++) {
-    Segment* s1 = segments->data[i];
-    arrayPush(pair, bitarrayNew(segments->size, 1));
+    Segment* s1 = segments->data + i;
+    uint64_t rev1 = packReverseComplement(s1->kmer, KMER_LONG_LEN);
     for (size_t j = 0; j < segments->size; j++) {
       if (i == j) {
         continue;
       }
-      Segment* s2 = segments->data[j];
-      uint64_t kmer = 0ULL;
-      uint64_t reverseKmer = 0ULL;
-      int c = 0;
+      Segment* s2 = segments->data + j;
+      uint64_t rev2 = packReverseComplement(s2->kmer, KMER_LONG_LEN);
+      unsigned __int128 junction
+          = ((unsigned __int128)(s1->kmer & half) << width) | (s2->kmer >> 2);
+      // reverse complement of the junction, read the other way
+      unsigned __int128 reverse
+          = ((unsigned __int128)(rev2 & half) << width) | (rev1 >> 2);
       int succ = 1;
-      for (int k = 1; k < s1->bases->size + s2->bases->size - 1; k++) {
-        char base = 4;
-        if (k >= s1->bases->size) {
-          base = bitarrayGet(s2->bases, k - s1->bases->size);
-        } else {
-          base = bitarrayGet(s1->bases, k);
-        }
-        kmer = ((kmer << 2) | base) & KMER_MASK;
-        reverseKmer =
-            (reverseKmer >> 2) | ((3ULL - base) << ((KMER_LEN - 1) * 2));
-        c++;
-        if (c < KMER_LEN) {
-          continue;
-        }
+      for (int k = 0; k < njunction; k++) {
+        kmer_t kmer = (junction >> (2 * (njunction - 1 - k))) & KMER_MASK;
+        kmer_t reverseKmer = (reverse >> (2 * k)) & KMER_MASK;
         // query index
-        if (bitarrayGet(index->index, kmer)
-            || bitarrayGet(index->index, reverseKmer)) {
+        if (indexHasKmer(index, kmer, reverseKmer)) {
           succ = 0;
           break;
         }
       }
       if (succ) {
         s1->vaild++;
-        bitarraySet(arrayGet(pair, i), j, 1);
+        bitarraySet(pair->rows[i], j, 1);
       }
     }
   }
   // remove all segments that have circle deps
-  for (int i = 0; i < segments->size; i++) {
-    for (int j = 0; j < segments->size; j++) {
+  for (size_t i = 0; i < segments->size; i++) {
+    for (size_t j = 0; j < segments->size; j++) {
       if (i == j) {
         continue;
       }
-      if (bitarrayGet(arrayGet(pair, i), j)
-          && bitarrayGet(arrayGet(pair, j), i)) {
-        bitarraySet(arrayGet(pair, j), i, 0);
-        ((Segment*)segments->data[i])->vaild--;
+      if (bitarrayGet(pair->rows[i], j) && bitarrayGet(pair->rows[j], i)) {
+        bitarraySet(pair->rows[j], i, 0);
+        segments->data[i].vaild--;
       }
     }
   }
-  qsort(segments->data, segments->size, sizeof(Segment**), cmpSegments);
+  qsort(segments->data, segments->size, sizeof(Segment), cmpSegments);
   return pair;
 }
 
 static inline void
-printPair(Array* pair, const char* path)
+printPair(PairMatrix* pair, const char* path)
 {
-  FILE* fp = fopen(path, "w");
-  if (fp == NULL) {
-    error("open file %s failed.", path);
-    exit(1);
-  }
-  for (size_t i = 0; i < pair->size; i++) {
-    for (size_t j = 0; j < pair->size; j++) {
-      fprintf(fp, "%d ", bitarrayGet(arrayGet(pair, i), j));
+  XWriter* writer = xwriter_open(path, xwriter_format_of(path));
+  size_t nchunks = (pair->size + DUMP_CHUNK_ROWS - 1) / DUMP_CHUNK_ROWS;
+  XBuffer** chunks = dmalloc(sizeof(XBuffer*) * (nchunks ? nchunks : 1));
+#ifdef ROA_PARALLEL
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (size_t c = 0; c < nchunks; c++) {
+    XBuffer* buff = xbuffer_new(pair->size * 2 * DUMP_CHUNK_ROWS);
+    size_t end = (c + 1) * DUMP_CHUNK_ROWS;
+    end = end < pair->size ? end : pair->size;
+    for (size_t i = c * DUMP_CHUNK_ROWS; i < end; i++) {
+      BitArray* row = pair->rows[i];
+      for (size_t j = 0; j < pair->size; j++) {
+        char cell[2] = { '0' + bitarrayGet(row, j), ' ' };
+        xbuffer_write(buff, cell, 2);
+      }
+      xbuffer_write(buff, "\n", 1);
     }
-    fprintf(fp, "\n");
+    chunks[c] = buff;
   }
-  fclose(fp);
+  for (size_t c = 0; c < nchunks; c++) {
+    xwriter_append(writer, chunks[c]);
+    xbuffer_free(chunks[c]);
+  }
+  dfree(chunks, sizeof(XBuffer*) * (nchunks ? nchunks : 1));
+  xwriter_close(writer);
 }
 
 static inline void
-freePairArray(Array* pair)
+freePairMatrix(PairMatrix* pair)
 {
-  for (size_t i = 0; i < pair->size; i++) {
-    bitarrayFree(pair->data[i]);
-  }
-  arrayFree(pair);
+  arenaFree(pair->arena);
+  dfree(pair, sizeof(PairMatrix));
 }
 
 #define checkJoin(pair, s1, s2)                                               \
-  (pair == NULL ? 1 : bitarrayGet(arrayGet(pair, (s1)->id), (s2)->id))
+  (pair == NULL ? 1 : bitarrayGet((pair)->rows[(s1)->id], (s2)->id))
 
 typedef struct Node Node;
 struct Node {
   Segment* segment;
-  int next_count;
+  size_t next_count;
   Node** next;
 };
 
-static inline Array*
-createCircle(Array* segments, Array* pair, int count)
+VEC_DEFINE(NodeRefVec, Node*)
+
+static inline SegmentRefVec*
+createCircle(SegmentVec* segments, PairMatrix* pair, int count)
 {
   size_t segmentSize = segments->size;
-  Array* result = arrayNew(count * KMER_PER_CIRCLE);
-  int offset = 0;
+  SegmentRefVec* result = SegmentRefVecNew(count * KMER_PER_CIRCLE);
+  size_t offset = 0;
   if (pair) {
     Segment *a, *b;
-    int span = 1000;
-    Node** nodes = dmalloc(sizeof(Node*) * segmentSize);
+    size_t span = 1000;
+    // the graph and the search state are scratch, dropped in one go
+    Arena* arena = arenaNew(1UL << 20);
+    Node* nodes = arenaAlloc(arena, sizeof(Node) * segmentSize);
+    NodeRefVec next;
+    NodeRefVecInit(&next);
     for (size_t i = 0; i < segmentSize; i++) {
-      nodes[i] = dmalloc(sizeof(Node));
-      nodes[i]->segment = segments->data[i];
-      nodes[i]->next_count = 0;
-      nodes[i]->next = NULL;
-    }
-
-    for (int i = 0; i < segmentSize; i++) {
-      a = segments->data[i];
-      nodes[i]->next = dmalloc(sizeof(Node*) * segmentSize);
-      for (int j = 0; j < segmentSize; j++) {
+      a = segments->data + i;
+      NodeRefVecClear(&next);
+      for (size_t j = 0; j < segmentSize; j++) {
         if (i == j) {
           continue;
         }
-        b = segments->data[j];
+        b = segments->data + j;
         if (checkJoin(pair, a, b)) {
           if (b->start - a->start < span || a->start - b->start < span) {
             continue;
           }
-          nodes[i]->next[nodes[i]->next_count] = nodes[j];
-          nodes[i]->next_count++;
+          NodeRefVecPush(&next, nodes + j);
         }
       }
+      nodes[i].segment = a;
+      nodes[i].next_count = next.size;
+      nodes[i].next = arenaAlloc(arena, sizeof(Node*) * next.size);
+      memcpy(nodes[i].next, next.data, sizeof(Node*) * next.size);
     }
+    NodeRefVecRelease(&next);
 
     int circle_count = 0;
     // dfs
-    Node** stack = dmalloc(sizeof(Node*) * segmentSize);
+    Node** stack = arenaAlloc(arena, sizeof(Node*) * segmentSize);
     int stack_size = 0;
-    int* visited = dmalloc(sizeof(int) * segmentSize);
-    for (int i = 0; i < segmentSize; i++) {
-      visited[i] = 0;
-    }
+    int* visited = arenaCalloc(arena, segmentSize, sizeof(int));
 
-    for (int i = 0; i < segmentSize; i++) {
+    for (size_t i = 0; i < segmentSize; i++) {
       if (visited[i]) {
         continue;
       }
       if (circle_count >= count) {
         break;
       }
-      stack[stack_size] = nodes[i];
+      stack[stack_size] = nodes + i;
       stack_size++;
       while (stack_size > 0) {
         if (circle_count >= count) {
@@ -673,7 +2094,7 @@ createCircle(Array* segments, Array* pair, int count)
         if (node->next_count == 0) {
           // find a circle
           for (int i = 0; i < KMER_PER_CIRCLE; i++) {
-            arrayPush(result, node->segment);
+            SegmentRefVecPush(result, node->segment);
             visited[node->segment->id] = 1;
           }
           circle_count++;
@@ -683,7 +2104,7 @@ createCircle(Array* segments, Array* pair, int count)
         if (stack_size == KMER_PER_CIRCLE) {
           // find a circle
           for (int i = 0; i < KMER_PER_CIRCLE; i++) {
-            arrayPush(result, stack[i]->segment);
+            SegmentRefVecPush(result, stack[i]->segment);
             visited[stack[i]->segment->id] = 1;
           }
           circle_count++;
@@ -691,7 +2112,7 @@ createCircle(Array* segments, Array* pair, int count)
           continue;
         }
         int find = 0;
-        for (int i = 0; i < node->next_count; i++) {
+        for (size_t i = 0; i < node->next_count; i++) {
           if (visited[node->next[i]->segment->id]) {
             continue;
           }
@@ -708,20 +2129,14 @@ createCircle(Array* segments, Array* pair, int count)
     }
 
     // free
-    for (int i = 0; i < segmentSize; i++) {
-      dfree(nodes[i]->next, sizeof(Node*) * segmentSize);
-      dfree(nodes[i], sizeof(Node));
-    }
-    dfree(nodes, sizeof(Node*) * segmentSize);
-    dfree(stack, sizeof(Node*) * segmentSize);
-    dfree(visited, sizeof(int) * segmentSize);
+    arenaFree(arena);
 
   } else {
     for (int i = 0; i < count; i++) {
       // generate a random circle
-      for (int j = 0; j < KMER_PER_CIRCLE; j++) {
+      for (int j = 0; j < KMER_PER_CIRCLE && offset < segmentSize; j++) {
         // find_circle;
-        arrayPush(result, segments->data[offset]);
+        SegmentRefVecPush(result, segments->data + offset);
         offset++;
       }
     }
@@ -732,39 +2147,93 @@ createCircle(Array* segments, Array* pair, int count)
 
 #define segmentToKmer(segment, kstr, rstr)                                    \
   do {                                                                        \
-    uint64_t kmer = 0;                                                        \
-    uint64_t reverseKmer = 0;                                                 \
-    for (int i = 0; i < KMER_LONG_LEN; i++) {                                 \
-      kmer = (kmer << 2) | bitarrayGet(segment->bases, i);                    \
-      reverseKmer = (reverseKmer >> 2)                                        \
-                    | ((3ULL - bitarrayGet(segment->bases, i))                \
-                       << ((KMER_LONG_LEN - 1) * 2));                         \
-    }                                                                         \
-    int2KmerString(kmer, KMER_LONG_LEN, (kstr));                              \
-    int2KmerString(reverseKmer, KMER_LONG_LEN, (rstr));                       \
+    int2KmerString((segment)->kmer, KMER_LONG_LEN, (kstr));                   \
+    int2KmerString(packReverseComplement((segment)->kmer, KMER_LONG_LEN),     \
+                   KMER_LONG_LEN, (rstr));                                    \
   } while (0)
 
+typedef enum {
+  DESIGN_OUT_FASTA,
+  DESIGN_OUT_TSV,    // one row per probe and circle, with a header
+  DESIGN_OUT_NDJSON, // one JSON object per probe and circle
+} DesignOutput;
+
+static inline void
+writeJsonString(XWriter* writer, const char* text)
+{
+  xwriter_write(writer, "\"", 1);
+  for (const char* c = text; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      xwriter_printf(writer, "\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      xwriter_printf(writer, "\\u%04x", *c);
+    } else {
+      xwriter_write(writer, c, 1);
+    }
+  }
+  xwriter_write(writer, "\"", 1);
+}
+
+static inline void
+saveProbe(XWriter* writer, DesignOutput output, int circle_id, int part,
+          Segment* s, const char* seq)
+{
+  if (output == DESIGN_OUT_TSV) {
+    xwriter_printf(writer, "probe\t%d\t%d\t%s\t%ld\t%s\n", circle_id, part,
+                   s->name, s->start, seq);
+  } else if (output == DESIGN_OUT_NDJSON) {
+    xwriter_printf(writer, "{\"type\":\"probe\",\"circle\":%d,\"part\":%d,"
+                   "\"query\":", circle_id, part);
+    writeJsonString(writer, s->name);
+    xwriter_printf(writer, ",\"start\":%ld,\"sequence\":\"%s\"}\n", s->start,
+                   seq);
+  } else {
+    xwriter_printf(writer, ">probe-%d/%d %s:%ld\n%s\n", circle_id, part,
+                   s->name, s->start, seq);
+  }
+}
+
+static inline void
+saveTemplate(XWriter* writer, DesignOutput output, int circle_id,
+             const char* seq)
+{
+  if (output == DESIGN_OUT_TSV) {
+    xwriter_printf(writer, "circle\t%d\t.\t.\t.\t%s\n", circle_id, seq);
+  } else if (output == DESIGN_OUT_NDJSON) {
+    xwriter_printf(writer,
+                   "{\"type\":\"circle\",\"circle\":%d,\"sequence\":\"%s\"}\n",
+                   circle_id, seq);
+  } else {
+    xwriter_printf(writer, ">circle-%d\n%s\n", circle_id, seq);
+  }
+}
+
 static inline void
-saveCircle(Array* circle, int count, const char* outpath)
+saveCircle(SegmentRefVec* circle, int count, const char* outpath,
+           DesignOutput output)
 {
-  FILE* fp = fopen(outpath, "w");
+  XWriter* writer = xwriter_open(outpath, xwriter_format_of(outpath));
+  if (output == DESIGN_OUT_TSV) {
+    xwriter_printf(writer, "type\tcircle\tpart\tquery\tstart\tsequence\n");
+  }
   char circle_template[100] = { 0 };
   char kmer_str[100] = { 0 };
   char reverseKmer_str[100] = { 0 };
   int circle_id = 1;
   int circle_sub_id = 0;
   int offset = 0;
-  int max_count = (circle->size + 3) / KMER_PER_CIRCLE;
+  // only whole circles
+  int max_count = circle->size / KMER_PER_CIRCLE;
   if (count > max_count) {
     info("count %d is larger than max count %d", count, max_count);
     info("set count to %d", max_count);
     count = max_count;
   }
   for (int i = 0; i < count * KMER_PER_CIRCLE; i++) {
-    Segment* s = (Segment*)circle->data[i];
+    Segment* s = circle->data[i];
     segmentToKmer(s, kmer_str, reverseKmer_str);
-    fprintf(fp, ">probe-%d/%d %s:%ld\n%s\n", circle_id, circle_sub_id + 1,
-            s->name, s->start, reverseKmer_str);
+    saveProbe(writer, output, circle_id, circle_sub_id + 1, s,
+              reverseKmer_str);
     circle_sub_id++;
     for (int j = 0; j < KMER_LONG_LEN; j++) {
       // copy from reverseKmer_str
@@ -772,57 +2241,49 @@ saveCircle(Array* circle, int count, const char* outpath)
       offset++;
     }
     if (circle_sub_id == KMER_PER_CIRCLE) {
-      fprintf(fp, ">circle-%d\n%s\n", circle_id, circle_template);
+      saveTemplate(writer, output, circle_id, circle_template);
       info("save circle %d/%d", circle_id, count);
       circle_id++;
       circle_sub_id = 0;
       offset = 0;
     }
   }
-  fclose(fp);
-}
-
-static inline void
-freeSegments(Array* segments)
-{
-  // free segments
-  for (size_t i = 0; i < segments->size; i++) {
-    Segment* s = segments->data[i];
-    bitarrayFree(s->bases);
-    dfree(s, sizeof(Segment));
-  }
-  arrayFree(segments);
+  xwriter_close(writer);
 }
 
 static inline void
-writeSegments(Array* segments, const char* output)
+writeSegments(SegmentVec* segments, const char* output)
 {
-  FILE* fp = fopen(output, "w");
-  if (fp == NULL) {
-    error("open file %s failed.", output);
-    exit(1);
-  }
-  char buff1[100];
-  char buff2[100];
-  uint64_t kmer = 0;
-  uint64_t reverseKmer = 0;
-  uint64_t kmerMask = (1ULL << (KMER_LONG_LEN * 2)) - 1;
-  uint64_t kmerShift = (KMER_LONG_LEN - 1) * 2;
-  fprintf(fp, "id\tchr\tstart\tend\tTm\tkmer\treverse_kmer\tcount\n");
-  for (size_t i = 0; i < segments->size; i++) {
-    Segment* s = segments->data[i];
-    for (int j = 0; j < KMER_LONG_LEN; j++) {
-      kmer = (kmer << 2) & kmerMask;
-      kmer |= bitarrayGet(s->bases, j);
-      reverseKmer = (reverseKmer >> 2) & kmerMask;
-      reverseKmer |= (3ULL - bitarrayGet(s->bases, j)) << kmerShift;
+  XWriter* writer = xwriter_open(output, xwriter_format_of(output));
+  xwriter_printf(writer,
+                 "id\tchr\tstart\tend\tTm\tkmer\treverse_kmer\tcount\n");
+  // rows are formatted a chunk per task and written in segment order
+  size_t nchunks = (segments->size + DUMP_CHUNK_ROWS - 1) / DUMP_CHUNK_ROWS;
+  XBuffer** chunks = dmalloc(sizeof(XBuffer*) * (nchunks ? nchunks : 1));
+#ifdef ROA_PARALLEL
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (size_t c = 0; c < nchunks; c++) {
+    XBuffer* buff = xbuffer_new(DUMP_CHUNK_ROWS * 128);
+    char buff1[100];
+    char buff2[100];
+    size_t end = (c + 1) * DUMP_CHUNK_ROWS;
+    end = end < segments->size ? end : segments->size;
+    for (size_t i = c * DUMP_CHUNK_ROWS; i < end; i++) {
+      Segment* s = segments->data + i;
+      segmentToKmer(s, buff1, buff2);
+      xbuffer_printf(buff, "%d\t%s\t%ld\t%ld\t%.2f\t%s\t%s\t%d\n", s->id,
+                     s->name, s->start + 1, s->end + 1, s->Tm, buff1, buff2,
+                     s->vaild);
     }
-    int2KmerString(kmer, KMER_LONG_LEN, buff1);
-    int2KmerString(reverseKmer, KMER_LONG_LEN, buff2);
-    fprintf(fp, "%d\t%s\t%ld\t%ld\t%.2f\t%s\t%s\t%d\n", s->id, s->name,
-            s->start + 1, s->end + 1, s->Tm, buff1, buff2, s->vaild);
+    chunks[c] = buff;
   }
-  fclose(fp);
+  for (size_t c = 0; c < nchunks; c++) {
+    xwriter_append(writer, chunks[c]);
+    xbuffer_free(chunks[c]);
+  }
+  dfree(chunks, sizeof(XBuffer*) * (nchunks ? nchunks : 1));
+  xwriter_close(writer);
 }
 
 #define p(...)                                                                \
@@ -840,8 +2301,15 @@ design_usage()
   p("  ./roa design -i index.index -q query.fa -o template.fa -pairCheck 1\n");
   p("Options:\n");
   p("  -i <index>    index file path\n");
-  p("  -q <query>    query file path\n");
-  p("  -o <output>   output file path [template.fa]\n");
+  p("  -exclude      comma separated references of a membership index to "
+    "avoid [all]\n");
+  p("  -mem <policy> index placement: none, thp or hugetlb pages, plus\n");
+  p("                interleave or replicate over NUMA nodes [none]\n");
+  p("  -q <query>    query file path, - for stdin\n");
+  p("  -names <list> comma separated query records to design [all]\n");
+  p("  -o <output>   output file path, - for stdout, .gz compresses "
+    "[template.fa]\n");
+  p("  -outfmt <fmt> fasta, tsv or ndjson records [fasta]\n");
   p("  -homopolymer  homopolymer length [3]\n");
   p("  -minGC        min GC rate [0.45]\n");
   p("  -maxGC        max GC rate [0.55]\n");
@@ -862,6 +2330,50 @@ index_usage()
   p("  ./roa index <index> <fa>...\n");
   p("Example:\n");
   p("  ./roa index index.index ref1.fa ref2.fa ...\n");
+  p("  zcat ref.fa.gz | ./roa index index.index -\n");
+  p("Options:\n");
+  p("  -t <threads>  number of build threads [all cores]\n");
+  p("  -format <fmt> index file format, gz (zlib blocks) or raw (mmap-able) "
+    "[gz]\n");
+  p("  -level <n>    zlib compression level of gz indexes, 0-9 [6]\n");
+  p("  -repr <repr>  dense bitmap, sparse set or hash set "
+    "[dense, k > 16: hash]\n");
+  p("  -build <mode> direct bitmap writes or radix bucketed writes [direct]\n");
+  p("  -membership   record which reference holds each kmer, up to 8 [0]\n");
+  p("  -canonical    store only the smaller of each kmer and its reverse "
+    "[0]\n");
+  p("  -h            show this help message\n");
+}
+
+void
+bench_usage()
+{
+  p("ROA Template Designer.\n");
+  p("Usage:\n");
+  p("  ./roa bench <fa>...\n");
+  p("  ./roa bench -i <index>\n");
+  p("Example:\n");
+  p("  ./roa bench -t 16 genome.fa\n");
+  p("  ./roa bench -i ref.index -mem thp,interleave\n");
+  p("Options:\n");
+  p("  -t <threads>  number of threads [all cores]\n");
+  p("  -i <index>    measure lookup throughput of an index instead\n");
+  p("  -mem <policy> placement to compare with none [all policies]\n");
+  p("  -n <probes>   random lookups per policy [67108864]\n");
+  p("  -h            show this help message\n");
+}
+
+void
+faidx_usage()
+{
+  p("ROA Template Designer.\n");
+  p("Usage:\n");
+  p("  ./roa faidx <fa> [region]...\n");
+  p("Example:\n");
+  p("  ./roa faidx query.fa\n");
+  p("  ./roa faidx query.fa gene1 gene2:101-200\n");
+  p("Writes <fa>.fai, the samtools compatible record index, and prints\n");
+  p("the given records or 1-based ranges of them as FASTA.\n");
   p("Options:\n");
   p("  -h            show this help message\n");
 }
@@ -875,6 +2387,8 @@ usage(int argc, char* argv[])
   p("Commands:\n");
   p("  index         create index file\n");
   p("  design        design ROA template\n");
+  p("  faidx         index a FASTA file and fetch records from it\n");
+  p("  bench         compare index build modes\n");
   return 0;
 }
 
@@ -901,7 +2415,11 @@ arginit(do_design)
   }
   const char* index_path = NULL;
   const char* query_path = NULL;
+  const char* exclude = NULL;
+  const char* names = NULL;
+  const char* mem = "none";
   const char* output_path = "template.fa";
+  const char* outfmt = "fasta";
   int homopolymer = 3;
   float minGC = 0.45;
   float maxGC = 0.55;
@@ -916,7 +2434,11 @@ arginit(do_design)
     argpass("-h");
     argstring("-i", index_path);
     argstring("-q", query_path);
+    argstring("-names", names);
+    argstring("-exclude", exclude);
+    argstring("-mem", mem);
     argstring("-o", output_path);
+    argstring("-outfmt", outfmt);
     argint("-homopolymer", homopolymer);
     argfloat("-minGC", minGC);
     argfloat("-maxGC", maxGC);
@@ -933,9 +2455,31 @@ arginit(do_design)
     design_usage();
     exit(1);
   }
+  MemPolicy policy;
+  if (!memParsePolicy(mem, &policy)) {
+    error("unknown memory policy %s.", mem);
+    exit(1);
+  }
+  DesignOutput output = DESIGN_OUT_FASTA;
+  if (strcmp(outfmt, "tsv") == 0) {
+    output = DESIGN_OUT_TSV;
+  } else if (strcmp(outfmt, "ndjson") == 0) {
+    output = DESIGN_OUT_NDJSON;
+  } else if (strcmp(outfmt, "fasta") != 0) {
+    error("unknown output format %s, expected fasta, tsv or ndjson.", outfmt);
+    exit(1);
+  }
+  if (strcmp(index_path, "-") == 0) {
+    error("the index must be read from a file.");
+    exit(1);
+  }
   info("index_path: %s", index_path);
   info("query_path: %s", query_path);
+  if (names) {
+    info("names: %s", names);
+  }
   info("output_path: %s", output_path);
+  info("outfmt: %s", outfmt);
   info("homopolymer: %d", homopolymer);
   info("minGC: %.2f", minGC);
   info("maxGC: %.2f", maxGC);
@@ -945,10 +2489,22 @@ arginit(do_design)
   info("avoidTIn3: %d", avoidTIn3);
   info("ncircle: %d", ncircle);
   info("pairCheck: %d", pairCheck);
+  memSetTag(MEM_TAG_INDEX);
   Index* index = loadIndex(index_path);
-  Query* query = createQuery(query_path, index);
+  for (int i = 0; i < index->nref; i++) {
+    info("reference %d: %s", i, indexRefName(index, i));
+  }
+  info("canonical: %d", index->canonical);
+  if (exclude) {
+    selectIndexRefs(index, exclude);
+    info("exclude: %s", exclude);
+  }
+  index = placeIndex(index, &policy);
+  memSetTag(MEM_TAG_QUERY);
+  Query* query = createQuery(query_path, names);
   vaildKmers(query, index);
-  Array* segments = collectSegment(query);
+  memSetTag(MEM_TAG_SEGMENT);
+  SegmentVec* segments = collectSegment(query);
   FilterOpts filterOpts = { .avoidCGIn3 = avoidCGIn3,
                             .avoidTIn3 = avoidTIn3,
                             .minGC = minGC,
@@ -958,28 +2514,49 @@ arginit(do_design)
                             .deComplementarity = 1,
                             .homeopolymer = homopolymer,
                             .ncircle = ncircle };
-  Array* filtered = filterSegment(segments, &filterOpts);
-  freeSegments(segments);
+  SegmentVec* filtered = filterSegment(segments, &filterOpts);
+  SegmentVecFree(segments);
   debug("fileter %zu segments", filtered->size);
   if (filtered->size) {
-    Array* pair = NULL;
+    PairMatrix* pair = NULL;
     if (pairCheck) {
+      memSetTag(MEM_TAG_PAIR);
       pair = pairJoinCheck(filtered, index);
+      memSetTag(MEM_TAG_SEGMENT);
     }
-    Array* circles = createCircle(filtered, pair, ncircle);
+    SegmentRefVec* circles = createCircle(filtered, pair, ncircle);
 
-    saveCircle(circles, ncircle, output_path);
+    saveCircle(circles, ncircle, output_path, output);
     if (pairCheck) {
-      freePairArray(pair);
+      memSetTag(MEM_TAG_PAIR);
+      freePairMatrix(pair);
+      memSetTag(MEM_TAG_SEGMENT);
     }
-    arrayFree(circles);
+    SegmentRefVecFree(circles);
   } else {
     info("no specific kmer found.");
   }
-  freeSegments(filtered);
+  SegmentVecFree(filtered);
+  memSetTag(MEM_TAG_QUERY);
   freeQuery(query);
+  memSetTag(MEM_TAG_INDEX);
   freeIndex(index);
-  debug("useMemory: %zu", getUsedMemory());
+  memSetTag(MEM_TAG_OTHER);
+}
+
+// apply -t; builds without OpenMP always run on one thread
+static inline void
+setThreads(int threads)
+{
+#ifdef ROA_PARALLEL
+  if (threads > 0) {
+    omp_set_num_threads(threads);
+  }
+#else
+  if (threads > 1) {
+    warn("built without OpenMP, -t %d is ignored.", threads);
+  }
+#endif
 }
 
 void
@@ -993,58 +2570,363 @@ do_index(int argc, char* argv[])
     index_usage();
     exit(1);
   }
-  const char* index_path = argv[0];
-  Index* index = NULL;
-  for (int i = 1; i < argc; i++) {
-    const char* ref_path = argv[i];
-    if (!isFileExist(ref_path)) {
-      error("file %s not exist.", ref_path);
+  int threads = 0;
+  const char* format_name = "gz";
+  const char* repr_name = KMER_DIRECT ? "dense" : "hash";
+  const char* build_name = "direct";
+  int level = Z_DEFAULT_COMPRESSION;
+  int membership = 0;
+  int canonical = 0;
+  Array* paths = arrayNew(argc);
+  argstart()
+  {
+    argpass("-h");
+    argint("-t", threads);
+    argstring("-format", format_name);
+    argstring("-repr", repr_name);
+    argstring("-build", build_name);
+    argint("-level", level);
+    argbool("-membership", membership);
+    argbool("-canonical", canonical);
+    argpositional(paths);
+    argend();
+  }
+  if (paths->size < 2) {
+    index_usage();
+    exit(1);
+  }
+  IndexFormat format = INDEX_FORMAT_BLOCK;
+  if (strcmp(format_name, "raw") == 0) {
+    format = INDEX_FORMAT_RAW;
+  } else if (strcmp(format_name, "gz") != 0) {
+    error("unknown index format %s, expected gz or raw.", format_name);
+    exit(1);
+  }
+  IndexRepr repr = INDEX_REPR_DENSE;
+  if (strcmp(repr_name, "sparse") == 0) {
+    repr = INDEX_REPR_SPARSE;
+  } else if (strcmp(repr_name, "hash") == 0) {
+    repr = INDEX_REPR_HASH;
+  } else if (strcmp(repr_name, "dense") != 0) {
+    error("unknown index representation %s, expected dense, sparse or hash.",
+          repr_name);
+    exit(1);
+  }
+  if (!KMER_DIRECT && repr != INDEX_REPR_HASH) {
+    error("k = %d is too long for a %s index, use -repr hash.", KMER_LEN,
+          repr_name);
+    exit(1);
+  }
+  IndexBuild build = INDEX_BUILD_DIRECT;
+  if (strcmp(build_name, "bucket") == 0) {
+    build = INDEX_BUILD_BUCKET;
+  } else if (strcmp(build_name, "direct") != 0) {
+    error("unknown build mode %s, expected direct or bucket.", build_name);
+    exit(1);
+  }
+  if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) {
+    error("compression level %d is out of range 0-9.", level);
+    exit(1);
+  }
+  IndexOpts opts = { .repr = repr, .build = build, .canonical = canonical };
+  setThreads(threads);
+  const char* index_path = paths->data[0];
+  if (strcmp(index_path, "-") == 0) {
+    error("the index must be written to a file.");
+    exit(1);
+  }
+  Array* refs = arrayNew(paths->size);
+  int nstdin = 0;
+  for (size_t i = 1; i < paths->size; i++) {
+    if (strcmp(paths->data[i], "-") == 0 && nstdin++) {
+      error("stdin can only be indexed once.");
+      exit(1);
+    }
+    if (strcmp(paths->data[i], "-") != 0 && !isFileExist(paths->data[i])) {
+      error("file %s not exist.", (char*)paths->data[i]);
       continue;
     }
+    arrayPush(refs, paths->data[i]);
+  }
+  if (refs->size == 0) {
+    error("no reference was indexed.");
+    exit(1);
+  }
+  if (membership && repr != INDEX_REPR_DENSE) {
+    error("membership indexes only support the dense representation.");
+    exit(1);
+  }
+  if (membership && refs->size > INDEX_MAX_REFS) {
+    error("membership indexes hold at most %d references, got %zu.",
+          INDEX_MAX_REFS, refs->size);
+    exit(1);
+  }
+  memSetTag(MEM_TAG_INDEX);
+  Index* index = NULL;
+  if (membership) {
+    index = newMembershipIndex(index_path, refs);
+    index->canonical = canonical;
+  }
+  for (size_t i = 0; i < refs->size; i++) {
+    const char* ref_path = refs->data[i];
     info("indexing %s", ref_path);
     char buff[1024] = { 0 };
     sprintf(buff, "%s.index", ref_path);
-    int exist = isFileExist(buff);
-    if (exist) {
-      if (index == NULL) {
-        index = loadIndex(buff);
-      } else {
-        Index* tmp = loadIndex(buff);
-        bitarrayOr(index->index, tmp->index);
-        freeIndex(tmp);
-      }
+    // streamed references get no <ref>.index cache
+    int stream = isStreamPath(ref_path);
+    Index* tmp = NULL;
+    if (!stream && isFileExist(buff)) {
+      tmp = loadIndex(buff);
     } else {
-      Index* tmp = createIndex(NULL, ref_path);
-      dumpIndex(tmp, buff);
-      if (index == NULL) {
-        index = tmp;
-      } else {
-        bitarrayOr(index->index, tmp->index);
-        freeIndex(tmp);
+      tmp = createIndex(NULL, ref_path, &opts);
+      if (!stream) {
+        dumpIndex(tmp, buff, format, level);
       }
     }
+    if (tmp->nref) {
+      error("%s is a membership index, not a reference cache.", buff);
+      exit(1);
+    }
+    if (tmp->canonical != canonical) {
+      error("cached index %s is %s, remove it to rebuild as %s.", buff,
+            tmp->canonical ? "canonical" : "plain",
+            canonical ? "canonical" : "plain");
+      exit(1);
+    }
+    if (membership) {
+      convertIndex(tmp, INDEX_REPR_DENSE);
+      addMembership(index, tmp, i);
+      freeIndex(tmp);
+    } else {
+      index = mergeIndex(index, tmp);
+    }
   }
+  convertIndex(index, repr);
   info("Saving to %s", index_path);
-  dumpIndex(index, index_path);
+  dumpIndex(index, index_path, format, level);
   freeIndex(index);
+  memSetTag(MEM_TAG_OTHER);
+  arrayFree(refs);
+  arrayFree(paths);
+}
+
+static inline double
+wallTime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// random lookups per second into the index placed by each memory policy
+static inline void
+benchLookup(const char* path, const char* mem, size_t nprobe)
+{
+  const char* all[] = { "none", "thp", "hugetlb", "thp,interleave",
+                        "thp,replicate" };
+  const char* one[] = { "none", mem };
+  const char** policies = mem ? one : all;
+  int npolicy = mem ? 2 : sizeof(all) / sizeof(all[0]);
+#ifdef ROA_PARALLEL
+  info("threads: %d", omp_get_max_threads());
+#endif
+  info("numa nodes: %d", memNodes());
+  double base = 0;
+  for (int m = 0; m < npolicy; m++) {
+    MemPolicy policy;
+    if (!memParsePolicy(policies[m], &policy)) {
+      error("unknown memory policy %s.", policies[m]);
+      exit(1);
+    }
+    Index* index = placeIndex(loadIndex(path), &policy);
+    // the first pass faults the pages in, the second one is timed
+    size_t hits = 0;
+    double elapsed = 0;
+    for (int pass = 0; pass < 2; pass++) {
+      double start = wallTime();
+      hits = 0;
+#ifdef ROA_PARALLEL
+#pragma omp parallel reduction(+ : hits)
+#endif
+      {
+        uint64_t state = 0x9e3779b97f4a7c15ULL;
+#ifdef ROA_PARALLEL
+        state ^= (uint64_t)omp_get_thread_num() << 32;
+#pragma omp for schedule(static)
+#endif
+        for (size_t i = 0; i < nprobe; i++) {
+          // xorshift64
+          state ^= state << 13;
+          state ^= state >> 7;
+          state ^= state << 17;
+          hits += indexHas(index, state & KMER_MASK) != 0;
+        }
+      }
+      elapsed = wallTime() - start;
+    }
+    double rate = nprobe / elapsed / 1e6;
+    if (m == 0) {
+      base = rate;
+    }
+    info("lookup %-14s %8.1f M/s  %.2fx  (%zu hits)", policies[m], rate,
+         rate / base, hits);
+    freeIndex(index);
+  }
+}
+
+// build a dense index of the references once per build mode, report the
+// wall time of each and check that they produce the same bitmap
+void
+do_bench(int argc, char* argv[])
+{
+  if (invoke_help(argc, argv) || argc < 1) {
+    bench_usage();
+    exit(1);
+  }
+  int threads = 0;
+  const char* index_path = NULL;
+  const char* mem = NULL;
+  int nprobe = 1 << 26;
+  Array* paths = arrayNew(argc);
+  argstart()
+  {
+    argpass("-h");
+    argint("-t", threads);
+    argstring("-i", index_path);
+    argstring("-mem", mem);
+    argint("-n", nprobe);
+    argpositional(paths);
+    argend();
+  }
+  if (index_path) {
+    setThreads(threads);
+    benchLookup(index_path, mem, nprobe);
+    arrayFree(paths);
+    return;
+  }
+  if (paths->size < 1) {
+    bench_usage();
+    exit(1);
+  }
+  if (!KMER_DIRECT) {
+    error("bench compares dense builds, which need k <= 16.");
+    exit(1);
+  }
+  setThreads(threads);
+#ifdef ROA_PARALLEL
+  info("threads: %d", omp_get_max_threads());
+#endif
+  const char* names[] = { "direct", "bucket" };
+  IndexBuild builds[] = { INDEX_BUILD_DIRECT, INDEX_BUILD_BUCKET };
+  Index* built[2] = { NULL, NULL };
+  double elapsed[2] = { 0 };
+  for (int m = 0; m < 2; m++) {
+    IndexOpts opts = { .repr = INDEX_REPR_DENSE, .build = builds[m] };
+    double start = wallTime();
+    for (size_t i = 0; i < paths->size; i++) {
+      built[m] = createIndex(built[m], paths->data[i], &opts);
+    }
+    elapsed[m] = wallTime() - start;
+    info("build %s: %.3fs", names[m], elapsed[m]);
+  }
+  if (memcmp(built[0]->index->data, built[1]->index->data,
+             built[0]->index->__realCols)
+      != 0) {
+    error("build modes disagree.");
+    exit(1);
+  }
+  info("bucket speedup: %.2fx", elapsed[0] / elapsed[1]);
+  freeIndex(built[0]);
+  freeIndex(built[1]);
+  arrayFree(paths);
+}
+
+// print region, "name" or "name:begin-end" with 1-based inclusive bounds,
+// as FASTA with 60 bases per line
+static inline void
+printFaidxRegion(Faidx* fai, const char* region)
+{
+  size_t len = strlen(region);
+  long id = faiFind(fai, region, len);
+  size_t begin = 0;
+  size_t end = SIZE_MAX;
+  const char* colon = strrchr(region, ':');
+  if (id < 0 && colon) {
+    id = faiFind(fai, region, colon - region);
+    char* rest = NULL;
+    begin = strtoull(colon + 1, &rest, 10);
+    if (begin == 0 || (*rest && *rest != '-')) {
+      error("bad region %s.", region);
+      exit(1);
+    }
+    begin--;
+    if (*rest == '-') {
+      end = strtoull(rest + 1, &rest, 10);
+    }
+  }
+  if (id < 0) {
+    error("record %s is not indexed.", region);
+    exit(1);
+  }
+  FaiRecord* record = fai->records + id;
+  end = end < record->length ? end : record->length;
+  printf(">%s\n", region);
+  char line[61];
+  for (size_t at = begin; at < end; at += 60) {
+    size_t n = faiFetch(fai, id, at, at + 60 < end ? at + 60 : end, line);
+    line[n] = '\0';
+    printf("%s\n", line);
+  }
+}
+
+void
+do_faidx(int argc, char* argv[])
+{
+  if (invoke_help(argc, argv) || argc < 1) {
+    faidx_usage();
+    exit(1);
+  }
+  const char* path = argv[0];
+  Faidx* fai = faiOpen(path);
+  if (fai == NULL) {
+    error("%s cannot be indexed, it must be a plain FASTA file with equally "
+          "long lines per record.",
+          path);
+    exit(1);
+  }
+  char* fai_path = faiPath(path);
+  if (!faiSave(fai, fai_path)) {
+    exit(1);
+  }
+  info("%zu records indexed in %s", fai->size, fai_path);
+  dfree(fai_path, strlen(path) + 5);
+  for (int i = 1; i < argc; i++) {
+    printFaidxRegion(fai, argv[i]);
+  }
+  faiFree(fai);
 }
 
 int
 main(int argc, char* argv[])
 {
   log_set_level(PGLOG_LEVEL_DEBUG);
+  atexit(memReport);
   if (argc < 2) {
     usage(argc, argv);
     return 0;
   }
   if (strcmp(argv[1], "index") == 0) {
     do_index(argc - 2, argv + 2);
-    return 0;
-  }
-  if (strcmp(argv[1], "design") == 0) {
+  } else if (strcmp(argv[1], "design") == 0) {
     do_design(argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "bench") == 0) {
+    do_bench(argc - 2, argv + 2);
+  } else if (strcmp(argv[1], "faidx") == 0) {
+    do_faidx(argc - 2, argv + 2);
+  } else {
+    usage(argc, argv);
     return 0;
   }
-  usage(argc, argv);
+  memFinish();
   return 0;
 }
@@ -0,0 +1,204 @@
+#pragma once
+#include "log.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Placement of large, randomly probed tables. Two independent choices:
+//   - page size: normal 4KB pages, transparent huge pages (madvise) or
+//     explicit hugetlbfs pages, which need vm.nr_hugepages to be reserved
+//   - NUMA: first touch, pages interleaved over every node, or one full
+//     copy per node that threads read from their own node
+// NUMA placement goes through the mbind syscall directly, so libnuma is
+// not needed; on a single node machine it degrades to a no-op.
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+
+#define MEM_HUGE_PAGE_SIZE (1UL << 21)
+#define MEM_MAX_NODES 64
+// mbind modes, from linux/mempolicy.h
+#define MEM_MPOL_BIND 2
+#define MEM_MPOL_INTERLEAVE 3
+
+typedef enum {
+  MEM_PAGES_NORMAL,
+  MEM_PAGES_THP,
+  MEM_PAGES_HUGETLB,
+} MemPages;
+
+typedef enum {
+  MEM_NUMA_LOCAL,      // first touch, usually the loading thread's node
+  MEM_NUMA_INTERLEAVE, // pages spread round robin over all nodes
+  MEM_NUMA_REPLICATE,  // one copy per node
+} MemNuma;
+
+typedef struct {
+  MemPages pages;
+  MemNuma numa;
+} MemPolicy;
+
+// parse a comma separated policy such as "thp,interleave"; 0 on error
+static inline int
+memParsePolicy(const char* text, MemPolicy* policy)
+{
+  policy->pages = MEM_PAGES_NORMAL;
+  policy->numa = MEM_NUMA_LOCAL;
+  const char* item = text;
+  while (*item) {
+    size_t len = strcspn(item, ",");
+    if (len == 4 && strncmp(item, "none", len) == 0) {
+    } else if (len == 3 && strncmp(item, "thp", len) == 0) {
+      policy->pages = MEM_PAGES_THP;
+    } else if (len == 7 && strncmp(item, "hugetlb", len) == 0) {
+      policy->pages = MEM_PAGES_HUGETLB;
+    } else if (len == 10 && strncmp(item, "interleave", len) == 0) {
+      policy->numa = MEM_NUMA_INTERLEAVE;
+    } else if (len == 9 && strncmp(item, "replicate", len) == 0) {
+      policy->numa = MEM_NUMA_REPLICATE;
+    } else {
+      return 0;
+    }
+    item += len;
+    if (*item == ',') {
+      item++;
+    }
+  }
+  return 1;
+}
+
+static inline const char*
+memPagesName(MemPages pages)
+{
+  const char* names[] = { "4k", "thp", "hugetlb" };
+  return names[pages];
+}
+
+static inline const char*
+memNumaName(MemNuma numa)
+{
+  const char* names[] = { "local", "interleave", "replicate" };
+  return names[numa];
+}
+
+// number of NUMA nodes, from the highest node in the online list
+static inline int
+memNodes()
+{
+  static int nodes = 0;
+  if (nodes) {
+    return nodes;
+  }
+  nodes = 1;
+  FILE* fp = fopen("/sys/devices/system/node/online", "r");
+  if (fp == NULL) {
+    return nodes;
+  }
+  char buff[256] = { 0 };
+  if (fgets(buff, sizeof(buff), fp)) {
+    // e.g. "0-1" or "0,2-3"; the last number is the highest node
+    char* last = buff;
+    for (char* p = buff; *p; p++) {
+      if ((*p == '-' || *p == ',') && p[1]) {
+        last = p + 1;
+      }
+    }
+    int highest = atoi(last);
+    if (highest >= 0 && highest < MEM_MAX_NODES) {
+      nodes = highest + 1;
+    }
+  }
+  fclose(fp);
+  return nodes;
+}
+
+// node of the cpu the calling thread first asked from; threads are expected
+// to stay put (OMP_PROC_BIND=true)
+static inline int
+memNode()
+{
+  static __thread int node = -1;
+  if (node < 0) {
+    unsigned cpu = 0;
+    unsigned n = 0;
+    if (syscall(SYS_getcpu, &cpu, &n, NULL) != 0 || n >= MEM_MAX_NODES) {
+      n = 0;
+    }
+    node = n;
+  }
+  return node;
+}
+
+static inline size_t
+memMapSize(size_t size, MemPages pages)
+{
+  if (pages == MEM_PAGES_NORMAL) {
+    return size;
+  }
+  return (size + MEM_HUGE_PAGE_SIZE - 1) / MEM_HUGE_PAGE_SIZE
+         * MEM_HUGE_PAGE_SIZE;
+}
+
+// Map size bytes of anonymous memory with the page size of the policy. With
+// numa MEM_NUMA_REPLICATE the pages are bound to node instead. hugetlb falls
+// back to transparent huge pages when no huge pages are reserved. The
+// returned mapping is *mapSize bytes long and must be munmap()ed.
+static inline void*
+memMap(size_t size, MemPolicy* policy, int node, size_t* mapSize)
+{
+  MemPages pages = policy->pages;
+  void* ptr = MAP_FAILED;
+  if (pages == MEM_PAGES_HUGETLB) {
+    *mapSize = memMapSize(size, pages);
+    ptr = mmap(NULL, *mapSize, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr == MAP_FAILED) {
+      warn("no hugetlb pages for %zu bytes, falling back to thp.", size);
+      pages = MEM_PAGES_THP;
+    }
+  }
+  if (ptr == MAP_FAILED) {
+    *mapSize = memMapSize(size, pages);
+    ptr = mmap(NULL, *mapSize, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+      error("mmap %zu bytes failed. %s", *mapSize, strerror(errno));
+      exit(1);
+    }
+  }
+  if (pages == MEM_PAGES_THP && madvise(ptr, *mapSize, MADV_HUGEPAGE) != 0) {
+    warn("transparent huge pages are not available. %s", strerror(errno));
+  }
+  int nodes = memNodes();
+  if (nodes > 1 && policy->numa != MEM_NUMA_LOCAL) {
+    // one spare word: the kernel reads maxnode - 1 bits
+    unsigned long mask[MEM_MAX_NODES / (8 * sizeof(unsigned long)) + 1]
+        = { 0 };
+    int mode = MEM_MPOL_INTERLEAVE;
+    if (policy->numa == MEM_NUMA_REPLICATE) {
+      mode = MEM_MPOL_BIND;
+      mask[node / (8 * sizeof(unsigned long))]
+          |= 1UL << (node % (8 * sizeof(unsigned long)));
+    } else {
+      for (int i = 0; i < nodes; i++) {
+        mask[i / (8 * sizeof(unsigned long))]
+            |= 1UL << (i % (8 * sizeof(unsigned long)));
+      }
+    }
+    if (syscall(SYS_mbind, ptr, *mapSize, mode, mask, MEM_MAX_NODES + 1, 0)
+        != 0) {
+      warn("mbind to %s failed. %s", memNumaName(policy->numa),
+           strerror(errno));
+    }
+  }
+  return ptr;
+}
@@ -0,0 +1,301 @@
+#pragma once
+#include "alloc.h"
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACK_X86 1
+#endif
+
+// 2-bit packing of nucleotide text. Bases are coded A0 C1 G2 T3 (either
+// case) and packed 32 to a word, base i at bits 2 * (i % 32) of word i / 32.
+// Every other byte is invalid: its code is garbage and its bit is set in an
+// N mask holding 64 bases per word. The code of a valid byte c is
+// ((c >> 1) ^ (c >> 2)) & 3, so the kernels need no lookup table.
+//
+// packBases() converts 64 bases per step with AVX2 or SSE2 where the cpu
+// has them and falls back to scalar code elsewhere.
+
+typedef struct {
+  size_t cap;      // bases the buffers can hold
+  size_t len;      // bases packed
+  uint64_t* words; // (cap + 31) / 32 words of 2-bit codes
+  uint64_t* nmask; // (cap + 63) / 64 words, bit set for invalid bases
+  MemTag tag;      // of the stage that made it, also charged when it grows
+} Packed;
+
+static inline size_t
+packCodeWords(size_t n)
+{
+  return (n + 31) / 32;
+}
+
+static inline size_t
+packMaskWords(size_t n)
+{
+  return (n + 63) / 64;
+}
+
+static inline Packed*
+packedNew(size_t cap)
+{
+  MemTag tag = memTag();
+  Packed* p = dmallocTag(sizeof(Packed), tag);
+  p->cap = cap;
+  p->len = 0;
+  p->tag = tag;
+  // one spare word so 64 base steps never straddle the end
+  p->words = dmallocTag(sizeof(uint64_t) * (packCodeWords(cap) + 1), tag);
+  p->nmask = dmallocTag(sizeof(uint64_t) * packMaskWords(cap), tag);
+  return p;
+}
+
+static inline void
+packedFree(Packed* p)
+{
+  if (p == NULL) {
+    return;
+  }
+  MemTag tag = p->tag;
+  dfreeTag(p->words, sizeof(uint64_t) * (packCodeWords(p->cap) + 1), tag);
+  dfreeTag(p->nmask, sizeof(uint64_t) * packMaskWords(p->cap), tag);
+  dfreeTag(p, sizeof(Packed), tag);
+}
+
+// grow p to hold n bases; not thread safe
+static inline void
+packedReserve(Packed* p, size_t n)
+{
+  if (n <= p->cap) {
+    return;
+  }
+  size_t cap = roundup(n);
+  p->words = dreallocTag(p->words,
+                         sizeof(uint64_t) * (packCodeWords(p->cap) + 1),
+                         sizeof(uint64_t) * (packCodeWords(cap) + 1), p->tag);
+  p->nmask = dreallocTag(p->nmask, sizeof(uint64_t) * packMaskWords(p->cap),
+                         sizeof(uint64_t) * packMaskWords(cap), p->tag);
+  p->cap = cap;
+}
+
+static inline int
+packInvalid(unsigned char c)
+{
+  c |= 0x20;
+  return !(c == 'a' || c == 'c' || c == 'g' || c == 't');
+}
+
+// spread the low 32 bits of x to the even bits of the result
+static inline uint64_t
+packSpread(uint64_t x)
+{
+  x &= 0xffffffffULL;
+  x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+  x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+  x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  x = (x | (x << 2)) & 0x3333333333333333ULL;
+  x = (x | (x << 1)) & 0x5555555555555555ULL;
+  return x;
+}
+
+// pack bases [from, n) one at a time; from is a multiple of 64
+static inline void
+packScalar(const char* seq, size_t from, size_t n, uint64_t* words,
+           uint64_t* nmask)
+{
+  for (size_t i = from; i < n; i += 64) {
+    size_t m = n - i < 64 ? n - i : 64;
+    uint64_t invalid = 0;
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    for (size_t j = 0; j < m; j++) {
+      unsigned char c = seq[i + j];
+      uint64_t code = ((c >> 1) ^ (c >> 2)) & 3;
+      invalid |= (uint64_t)packInvalid(c) << j;
+      if (j < 32) {
+        lo |= code << (2 * j);
+      } else {
+        hi |= code << (2 * (j - 32));
+      }
+    }
+    words[i / 32] = lo;
+    words[i / 32 + 1] = hi;
+    nmask[i / 64] = invalid;
+  }
+}
+
+#ifdef PACK_X86
+__attribute__((target("avx2"))) static inline void
+packAvx2(const char* seq, size_t n, uint64_t* words, uint64_t* nmask)
+{
+  const __m256i lower = _mm256_set1_epi8(0x20);
+  const __m256i three = _mm256_set1_epi8(3);
+  const __m256i a = _mm256_set1_epi8('a');
+  const __m256i c = _mm256_set1_epi8('c');
+  const __m256i g = _mm256_set1_epi8('g');
+  const __m256i t = _mm256_set1_epi8('t');
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    uint64_t valid = 0;
+    for (int h = 0; h < 2; h++) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(seq + i + h * 32));
+      __m256i l = _mm256_or_si256(v, lower);
+      __m256i ok = _mm256_or_si256(
+          _mm256_or_si256(_mm256_cmpeq_epi8(l, a), _mm256_cmpeq_epi8(l, c)),
+          _mm256_or_si256(_mm256_cmpeq_epi8(l, g), _mm256_cmpeq_epi8(l, t)));
+      valid |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ok) << (h * 32);
+      // 16-bit shifts leak bits across bytes, but only into bits 6-7
+      __m256i code = _mm256_and_si256(
+          _mm256_xor_si256(_mm256_srli_epi16(v, 1), _mm256_srli_epi16(v, 2)),
+          three);
+      uint32_t bit0
+          = (uint32_t)_mm256_movemask_epi8(_mm256_slli_epi16(code, 7));
+      uint32_t bit1
+          = (uint32_t)_mm256_movemask_epi8(_mm256_slli_epi16(code, 6));
+      words[i / 32 + h] = packSpread(bit0) | (packSpread(bit1) << 1);
+    }
+    nmask[i / 64] = ~valid;
+  }
+  packScalar(seq, i, n, words, nmask);
+}
+#endif
+
+#if defined(PACK_X86) && defined(__SSE2__)
+static inline void
+packSse2(const char* seq, size_t n, uint64_t* words, uint64_t* nmask)
+{
+  const __m128i lower = _mm_set1_epi8(0x20);
+  const __m128i three = _mm_set1_epi8(3);
+  const __m128i a = _mm_set1_epi8('a');
+  const __m128i c = _mm_set1_epi8('c');
+  const __m128i g = _mm_set1_epi8('g');
+  const __m128i t = _mm_set1_epi8('t');
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    uint64_t valid = 0;
+    uint64_t bit0 = 0;
+    uint64_t bit1 = 0;
+    for (int q = 0; q < 4; q++) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(seq + i + q * 16));
+      __m128i l = _mm_or_si128(v, lower);
+      __m128i ok = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(l, a), _mm_cmpeq_epi8(l, c)),
+          _mm_or_si128(_mm_cmpeq_epi8(l, g), _mm_cmpeq_epi8(l, t)));
+      valid |= (uint64_t)(uint16_t)_mm_movemask_epi8(ok) << (q * 16);
+      __m128i code = _mm_and_si128(
+          _mm_xor_si128(_mm_srli_epi16(v, 1), _mm_srli_epi16(v, 2)), three);
+      bit0 |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_slli_epi16(code, 7))
+              << (q * 16);
+      bit1 |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_slli_epi16(code, 6))
+              << (q * 16);
+    }
+    words[i / 32] = packSpread(bit0) | (packSpread(bit1) << 1);
+    words[i / 32 + 1] = packSpread(bit0 >> 32) | (packSpread(bit1 >> 32) << 1);
+    nmask[i / 64] = ~valid;
+  }
+  packScalar(seq, i, n, words, nmask);
+}
+#endif
+
+typedef void (*PackKernel)(const char*, size_t, uint64_t*, uint64_t*);
+
+static inline void
+packScalarAll(const char* seq, size_t n, uint64_t* words, uint64_t* nmask)
+{
+  packScalar(seq, 0, n, words, nmask);
+}
+
+// the widest kernel the running cpu supports
+static inline PackKernel
+packKernel()
+{
+  static PackKernel kernel = NULL;
+  if (kernel) {
+    return kernel;
+  }
+  PackKernel chosen = packScalarAll;
+#if defined(PACK_X86) && defined(__SSE2__)
+  chosen = packSse2;
+#endif
+#ifdef PACK_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    chosen = packAvx2;
+  }
+#endif
+  __atomic_store_n(&kernel, chosen, __ATOMIC_RELAXED);
+  return chosen;
+}
+
+// pack the n bases of seq into p, which must have room for them
+static inline void
+packBases(Packed* p, const char* seq, size_t n)
+{
+  packKernel()(seq, n, p->words, p->nmask);
+  p->len = n;
+}
+
+static inline uint64_t
+packCode(const Packed* p, size_t i)
+{
+  return (p->words[i >> 5] >> ((i & 31) * 2)) & 3;
+}
+
+// reverse complement of a k-mer of k <= 32 codes, first base in the high bits
+static inline uint64_t
+packReverseComplement(uint64_t kmer, int k)
+{
+  // complementing a code is 3 - c, so flip every bit, then reverse the codes
+  kmer = ~kmer;
+  kmer = ((kmer >> 2) & 0x3333333333333333ULL)
+         | ((kmer & 0x3333333333333333ULL) << 2);
+  kmer = ((kmer >> 4) & 0x0f0f0f0f0f0f0f0fULL)
+         | ((kmer & 0x0f0f0f0f0f0f0f0fULL) << 4);
+  kmer = ((kmer >> 8) & 0x00ff00ff00ff00ffULL)
+         | ((kmer & 0x00ff00ff00ff00ffULL) << 8);
+  kmer = ((kmer >> 16) & 0x0000ffff0000ffffULL)
+         | ((kmer & 0x0000ffff0000ffffULL) << 16);
+  kmer = (kmer >> 32) | (kmer << 32);
+  return kmer >> (64 - 2 * k);
+}
+
+// number of G and C among the codes of kmer
+static inline int
+packGC(uint64_t kmer)
+{
+  // C1 and G2 are the codes whose two bits differ
+  return __builtin_popcountll((kmer ^ (kmer >> 1)) & 0x5555555555555555ULL);
+}
+
+// Roll over the packed bases and run body for every k-mer without invalid
+// bases, with pos bound to the position of its last base, kmer to the
+// forward k-mer (first base in the high bits) and rev to its reverse
+// complement. k is at most 32.
+#define packForeachKmer(p, k, kmer, rev, pos, body)                           \
+  do {                                                                        \
+    const uint64_t __kmask                                                    \
+        = (k) >= 32 ? ~0ULL : (1ULL << (2 * (k))) - 1;                        \
+    const int __top = 2 * (k) - 2;                                            \
+    uint64_t kmer = 0;                                                        \
+    uint64_t rev = 0;                                                         \
+    size_t __count = 0;                                                       \
+    for (size_t __b = 0; __b < packMaskWords((p)->len); __b++) {              \
+      uint64_t __n = (p)->nmask[__b];                                         \
+      size_t __end = (p)->len - __b * 64 < 64 ? (p)->len - __b * 64 : 64;     \
+      for (size_t __j = 0; __j < __end; __j++) {                              \
+        size_t pos = __b * 64 + __j;                                          \
+        if ((__n >> __j) & 1) {                                               \
+          kmer = 0;                                                           \
+          rev = 0;                                                            \
+          __count = 0;                                                        \
+          continue;                                                           \
+        }                                                                     \
+        uint64_t __c = packCode((p), pos);                                    \
+        kmer = ((kmer << 2) | __c) & __kmask;                                 \
+        rev = (rev >> 2) | ((3 - __c) << __top);                              \
+        if (++__count >= (size_t)(k)) {                                       \
+          body;                                                               \
+        }                                                                     \
+      }                                                                       \
+    }                                                                         \
+  } while (0)
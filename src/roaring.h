@@ -0,0 +1,238 @@
+#pragma once
+#include "alloc.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// A read-mostly set of 32-bit keys laid out like a roaring bitmap, but flat:
+// the high 16 bits select one of 65536 buckets, and every bucket stores its
+// low 16 bits as a container inside one shared array of uint16 words.
+//   - fewer than ROARING_ARRAY_MAX keys: a sorted array of low halves
+//   - otherwise: a 65536-bit bitmap (ROARING_ARRAY_MAX words)
+// The container kind follows from its length, so offsets + words is the whole
+// structure and can be written to disk or mapped back without fixups.
+
+#define ROARING_BUCKETS (1UL << 16)
+#define ROARING_ARRAY_MAX 4096
+
+typedef struct {
+  size_t cardinality;
+  size_t nwords;
+  uint32_t* offsets; // ROARING_BUCKETS + 1 word offsets into words
+  uint16_t* words;
+} Roaring;
+
+static inline size_t
+roaringOffsetsBytes()
+{
+  return sizeof(uint32_t) * (ROARING_BUCKETS + 1);
+}
+
+static inline size_t
+roaringBytes(Roaring* r)
+{
+  return roaringOffsetsBytes() + sizeof(uint16_t) * r->nwords;
+}
+
+static inline void
+roaringFree(Roaring* r)
+{
+  if (r == NULL) {
+    return;
+  }
+  dfree(r->offsets, roaringOffsetsBytes());
+  dfree(r->words, sizeof(uint16_t) * (r->nwords ? r->nwords : 1));
+  dfree(r, sizeof(Roaring));
+}
+
+// offsets read from a file must be non-decreasing and stay inside the words
+static inline int
+roaringValid(Roaring* r)
+{
+  for (size_t i = 0; i < ROARING_BUCKETS; i++) {
+    if (r->offsets[i] > r->offsets[i + 1]) {
+      return 0;
+    }
+  }
+  return r->offsets[ROARING_BUCKETS] <= r->nwords;
+}
+
+static inline int
+roaringContains(Roaring* r, uint32_t key)
+{
+  uint32_t hi = key >> 16;
+  uint16_t lo = key & 0xffff;
+  uint32_t b = r->offsets[hi];
+  uint32_t n = r->offsets[hi + 1] - b;
+  const uint16_t* c = r->words + b;
+  if (n == ROARING_ARRAY_MAX) {
+    return (c[lo >> 4] >> (lo & 0xf)) & 1;
+  }
+  uint32_t left = 0;
+  uint32_t right = n;
+  while (left < right) {
+    uint32_t mid = (left + right) >> 1;
+    if (c[mid] < lo) {
+      left = mid + 1;
+    } else {
+      right = mid;
+    }
+  }
+  return left < n && c[left] == lo;
+}
+
+// append the container for one bucket, given as a 65536-bit scratch bitmap,
+// and return the number of keys in it
+static inline size_t
+roaringEmit(uint16_t* out, size_t* nwords, const uint64_t* scratch)
+{
+  size_t card = 0;
+  for (size_t i = 0; i < ROARING_ARRAY_MAX / 4; i++) {
+    card += __builtin_popcountll(scratch[i]);
+  }
+  if (card >= ROARING_ARRAY_MAX) {
+    memcpy(out + *nwords, scratch, sizeof(uint16_t) * ROARING_ARRAY_MAX);
+    *nwords += ROARING_ARRAY_MAX;
+    return card;
+  }
+  for (size_t i = 0; i < ROARING_ARRAY_MAX / 4; i++) {
+    uint64_t w = scratch[i];
+    while (w) {
+      out[(*nwords)++] = (uint16_t)(i * 64 + __builtin_ctzll(w));
+      w &= w - 1;
+    }
+  }
+  return card;
+}
+
+// OR the container of bucket hi into a 65536-bit scratch bitmap
+static inline void
+roaringScatter(Roaring* r, uint32_t hi, uint64_t* scratch)
+{
+  uint32_t b = r->offsets[hi];
+  uint32_t n = r->offsets[hi + 1] - b;
+  const uint16_t* c = r->words + b;
+  if (n == ROARING_ARRAY_MAX) {
+    for (size_t i = 0; i < ROARING_ARRAY_MAX / 4; i++) {
+      uint64_t w;
+      memcpy(&w, c + i * 4, sizeof(uint64_t));
+      scratch[i] |= w;
+    }
+    return;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    scratch[c[i] >> 6] |= 1ULL << (c[i] & 0x3f);
+  }
+}
+
+static inline Roaring*
+roaringAlloc(size_t nwords)
+{
+  Roaring* r = dmalloc(sizeof(Roaring));
+  r->cardinality = 0;
+  r->nwords = nwords;
+  r->offsets = dmalloc(roaringOffsetsBytes());
+  r->words = dmalloc(sizeof(uint16_t) * (nwords ? nwords : 1));
+  return r;
+}
+
+static inline void
+roaringShrink(Roaring* r, size_t nwords)
+{
+  size_t old = r->nwords ? r->nwords : 1;
+  r->words = drealloc(r->words, sizeof(uint16_t) * old,
+                      sizeof(uint16_t) * (nwords ? nwords : 1));
+  r->nwords = nwords;
+}
+
+// build a set from unsorted keys that may contain duplicates
+static inline Roaring*
+roaringFromKeys(const uint32_t* keys, size_t n)
+{
+  uint32_t* counts = dmalloc(sizeof(uint32_t) * (ROARING_BUCKETS + 1));
+  memset(counts, 0, sizeof(uint32_t) * (ROARING_BUCKETS + 1));
+  for (size_t i = 0; i < n; i++) {
+    counts[(keys[i] >> 16) + 1]++;
+  }
+  size_t upper = 0;
+  for (size_t i = 1; i <= ROARING_BUCKETS; i++) {
+    upper += counts[i] < ROARING_ARRAY_MAX ? counts[i] : ROARING_ARRAY_MAX;
+    counts[i] += counts[i - 1];
+  }
+  // bucket the low halves by their high halves
+  uint16_t* lows = dmalloc(sizeof(uint16_t) * (n ? n : 1));
+  uint32_t* fill = dmalloc(sizeof(uint32_t) * ROARING_BUCKETS);
+  memcpy(fill, counts, sizeof(uint32_t) * ROARING_BUCKETS);
+  for (size_t i = 0; i < n; i++) {
+    lows[fill[keys[i] >> 16]++] = keys[i] & 0xffff;
+  }
+  dfree(fill, sizeof(uint32_t) * ROARING_BUCKETS);
+
+  Roaring* r = roaringAlloc(upper);
+  uint64_t scratch[ROARING_ARRAY_MAX / 4];
+  size_t nwords = 0;
+  for (size_t hi = 0; hi < ROARING_BUCKETS; hi++) {
+    r->offsets[hi] = nwords;
+    if (counts[hi] == counts[hi + 1]) {
+      continue;
+    }
+    memset(scratch, 0, sizeof(scratch));
+    for (uint32_t i = counts[hi]; i < counts[hi + 1]; i++) {
+      scratch[lows[i] >> 6] |= 1ULL << (lows[i] & 0x3f);
+    }
+    r->cardinality += roaringEmit(r->words, &nwords, scratch);
+  }
+  r->offsets[ROARING_BUCKETS] = nwords;
+  roaringShrink(r, nwords);
+  dfree(lows, sizeof(uint16_t) * (n ? n : 1));
+  dfree(counts, sizeof(uint32_t) * (ROARING_BUCKETS + 1));
+  return r;
+}
+
+static inline Roaring*
+roaringUnion(Roaring* a, Roaring* b)
+{
+  Roaring* r = roaringAlloc(a->nwords + b->nwords);
+  uint64_t scratch[ROARING_ARRAY_MAX / 4];
+  size_t nwords = 0;
+  for (size_t hi = 0; hi < ROARING_BUCKETS; hi++) {
+    r->offsets[hi] = nwords;
+    if (a->offsets[hi] == a->offsets[hi + 1]
+        && b->offsets[hi] == b->offsets[hi + 1]) {
+      continue;
+    }
+    memset(scratch, 0, sizeof(scratch));
+    roaringScatter(a, hi, scratch);
+    roaringScatter(b, hi, scratch);
+    r->cardinality += roaringEmit(r->words, &nwords, scratch);
+  }
+  r->offsets[ROARING_BUCKETS] = nwords;
+  roaringShrink(r, nwords);
+  return r;
+}
+
+// run body with key bound to every member, in ascending order
+#define roaringForeach(r, key, body)                                          \
+  do {                                                                        \
+    for (uint32_t __hi = 0; __hi < ROARING_BUCKETS; __hi++) {                 \
+      uint32_t __b = (r)->offsets[__hi];                                      \
+      uint32_t __n = (r)->offsets[__hi + 1] - __b;                            \
+      const uint16_t* __c = (r)->words + __b;                                 \
+      if (__n == ROARING_ARRAY_MAX) {                                         \
+        for (uint32_t __i = 0; __i < ROARING_ARRAY_MAX / 4; __i++) {          \
+          uint64_t __w;                                                       \
+          memcpy(&__w, __c + __i * 4, sizeof(uint64_t));                      \
+          while (__w) {                                                       \
+            uint32_t key = (__hi << 16) | (__i * 64 + __builtin_ctzll(__w));  \
+            body;                                                             \
+            __w &= __w - 1;                                                   \
+          }                                                                   \
+        }                                                                     \
+      } else {                                                                \
+        for (uint32_t __i = 0; __i < __n; __i++) {                            \
+          uint32_t key = (__hi << 16) | __c[__i];                             \
+          body;                                                               \
+        }                                                                     \
+      }                                                                       \
+    }                                                                         \
+  } while (0)
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "alloc.h"
+#include "arena.h"
 #include "file.h"
 #include "log.h"
 
@@ -58,6 +59,24 @@ free_seq(Seq* seq)
   dfree(seq, sizeof(Seq));
 }
 
+// deep copy of a record, sized to its length
+static inline Seq*
+clone_seq(Seq* seq)
+{
+  Seq* copy = (Seq*)dmalloc(sizeof(Seq));
+  size_t name_len = seq->name ? strlen(seq->name) : 0;
+  copy->name = (char*)dmalloc(sizeof(char) * (name_len + 1));
+  memcpy(copy->name, seq->name ? seq->name : "", name_len);
+  copy->name[name_len] = '\0';
+  copy->len = seq->len;
+  copy->cap = seq->len;
+  copy->seq = (char*)dmalloc(sizeof(char) * (seq->len + 1));
+  memcpy(copy->seq, seq->seq, seq->len);
+  copy->seq[seq->len] = '\0';
+  copy->qual = NULL;
+  return copy;
+}
+
 static inline Seq*
 seq_shrink(Seq* seq)
 {
@@ -70,66 +89,6 @@ seq_shrink(Seq* seq)
   return seq;
 }
 
-static inline Seq*
-__read_fasta(XFile* file, XFileHandle* handle, Seq* s)
-{
-  Seq* seq = s;
-  line_t* line = NULL;
-  if (file->offset && file->line == NULL) {
-    if (seq) {
-      handle->close(file);
-      free_seq(seq);
-    }
-    return NULL;
-  }
-  if (seq == NULL) {
-    seq = init_seq(SeqInitSize, FASTA);
-  } else {
-    seq->len = 0;
-    dfree(seq->name, sizeof(char) * (strlen(seq->name) + 1));
-    seq->name = NULL;
-  }
-  if (file->line && file->line->size && file->line->line[0] == '>') {
-    line = file->line;
-    seq->name = (char*)dmalloc(line->size);
-    memcpy(seq->name, line->line + 1, line->size - 1);
-    seq->name[line->size - 1] = '\0';
-  }
-  while ((line = handle->readline(file, line)) != NULL) {
-    if (line->size == 0) {
-      continue;
-    }
-    if (line->size && line->line && line->line[0] == '>') {
-      if (seq->name != NULL) {
-        return seq;
-      }
-      seq->name = (char*)dmalloc(line->size);
-      memcpy(seq->name, line->line + 1, line->size - 1);
-      seq->name[line->size - 1] = '\0';
-      continue;
-    }
-    if (seq->len + line->size > seq->cap) {
-      size_t old_cap = seq->cap;
-      seq->cap = roundup(seq->len + line->size);
-      if (seq->seq) {
-        seq->seq = (char*)drealloc(seq->seq, old_cap + 1, seq->cap + 1);
-      } else {
-        seq->seq = (char*)dmalloc(seq->cap + 1);
-      }
-    }
-    memcpy(seq->seq + seq->len, line->line, line->size);
-    seq->len += line->size;
-    seq->seq[seq->len] = '\0';
-  }
-  if (seq && !seq->len) {
-    debug("finish read fasta file: %s\n", file->path);
-    free_seq(seq);
-    handle->close(file);
-    return NULL;
-  }
-  return seq;
-}
-
 static inline Seq*
 __read_fastq(XFile* file, XFileHandle* handle, Seq* s)
 {
@@ -206,15 +165,6 @@ clean:
   return NULL;
 }
 
-#define iter_fasta(path, seq)                                                 \
-  XFileHandle handle = choice_handle(path);                                   \
-  XFile* file = handle.open(path, "rb");                                      \
-  if (file == NULL) {                                                         \
-    fprintf(stderr, "Open file: %s failed.\n", path);                         \
-    exit(1);                                                                  \
-  }                                                                           \
-  while ((seq = __read_fasta(file, &handle, seq)) != NULL)
-
 #define iter_fastq(path, seq)                                                 \
   XFileHandle handle = choice_handle(path);                                   \
   XFile* file = handle.open(path, "rb");                                      \
@@ -222,4 +172,296 @@ clean:
     fprintf(stderr, "Open file: %s failed.\n", path);                         \
     return 1;                                                                 \
   }                                                                           \
+  handle.readahead(file);                                                     \
   while ((seq = __read_fastq(file, &handle, seq)) != NULL)
+
+// Records read in bulk. Names and bases live in an arena owned by the
+// batch, so records stay valid while the reader moves on and other threads
+// work on them, and the batch is released in one go. A cleared batch keeps
+// the arena chunks for the next read.
+
+#define SEQ_CHUNK_SIZE (1024 * 1024 * 4) // 4MB
+
+typedef struct {
+  Seq* seqs; // name and seq point into the arena, qual is NULL
+  size_t size;
+  size_t capacity;
+  size_t bases; // total length of the records
+  Arena* arena;
+} SeqBatch;
+
+static inline SeqBatch*
+seq_batch_new()
+{
+  SeqBatch* batch = dmalloc(sizeof(SeqBatch));
+  batch->seqs = NULL;
+  batch->size = 0;
+  batch->capacity = 0;
+  batch->bases = 0;
+  batch->arena = arenaNew(SEQ_CHUNK_SIZE);
+  return batch;
+}
+
+static inline void
+seq_batch_clear(SeqBatch* batch)
+{
+  batch->size = 0;
+  batch->bases = 0;
+  arenaReset(batch->arena);
+}
+
+static inline void
+seq_batch_free(SeqBatch* batch)
+{
+  if (batch == NULL) {
+    return;
+  }
+  MemTag tag = batch->arena->tag;
+  arenaFree(batch->arena);
+  if (batch->seqs) {
+    dfreeTag(batch->seqs, sizeof(Seq) * batch->capacity, tag);
+  }
+  dfreeTag(batch, sizeof(SeqBatch), tag);
+}
+
+// a new record slot at the end of batch; records added earlier may move,
+// their data not
+static inline Seq*
+__seq_batch_slot(SeqBatch* batch)
+{
+  if (batch->size == batch->capacity) {
+    size_t cap = roundup(batch->capacity + 1);
+    MemTag tag = batch->arena->tag;
+    if (batch->seqs) {
+      batch->seqs = dreallocTag(batch->seqs, sizeof(Seq) * batch->capacity,
+                                sizeof(Seq) * cap, tag);
+    } else {
+      batch->seqs = dmallocTag(sizeof(Seq) * cap, tag);
+    }
+    batch->capacity = cap;
+  }
+  return batch->seqs + batch->size++;
+}
+
+// Append a record with room for a name_len byte name and len bases, both
+// NUL terminated. The records are charged to the tag of the arena,
+// whichever thread adds them.
+static inline Seq*
+seq_batch_add(SeqBatch* batch, size_t name_len, size_t len)
+{
+  Seq* seq = __seq_batch_slot(batch);
+  seq->name = arenaAlloc(batch->arena, name_len + 1 + len + 1);
+  seq->name[name_len] = '\0';
+  seq->seq = seq->name + name_len + 1;
+  seq->seq[len] = '\0';
+  seq->qual = NULL;
+  seq->len = len;
+  seq->cap = len;
+  batch->bases += len;
+  return seq;
+}
+
+// append a copy of seq
+static inline Seq*
+seq_batch_push(SeqBatch* batch, Seq* seq)
+{
+  size_t name_len = seq->name ? strlen(seq->name) : 0;
+  Seq* copy = seq_batch_add(batch, name_len, seq->len);
+  memcpy(copy->name, seq->name ? seq->name : "", name_len);
+  memcpy(copy->seq, seq->seq, seq->len);
+  return copy;
+}
+
+// Read the next record straight out of the file's read buffer into a new
+// record of batch: headers are found at line starts, and the bytes between
+// line ends are appended to the record, which grows in the batch arena as
+// name, NUL, bases, NUL, so sequence data is copied once. The buffer is left
+// at the '>' of the following record. Returns NULL, with the file closed,
+// at the end of input.
+static inline Seq*
+__read_fasta(XFile* file, XFileHandle* handle, SeqBatch* batch)
+{
+  Seq* seq = __seq_batch_slot(batch);
+  size_t cap = SeqInitSize;
+  char* data = arenaAlloc(batch->arena, cap);
+  size_t size = 0;     // bytes of data, without the last NUL
+  size_t name_len = 0; // the name is complete once it is NUL terminated
+  int named = 0;
+  int line_start = 1;
+  int in_header = 0;
+  int eof = 0;
+  size_t seq_line = 0; // size where the current line started
+  while (1) {
+    if (file->buff_offset >= file->buff_size && !handle->fill(file)) {
+      eof = 1;
+      break;
+    }
+    char* start = file->buff + file->buff_offset;
+    size_t avail = file->buff_size - file->buff_offset;
+    if (line_start && start[0] == '>') {
+      if (named || size) {
+        break;
+      }
+      in_header = 1;
+      start++;
+      avail--;
+      file->buff_offset++;
+    }
+    line_start = 0;
+    char* end = memchr(start, LF, avail);
+    size_t n = end ? (size_t)(end - start) : avail;
+    file->buff_offset += end ? n + 1 : n;
+    // room for the NUL after the name and the last one
+    if (size + n + 2 > cap) {
+      size_t grown = roundup(size + n + 2);
+      data = arenaGrow(batch->arena, data, cap, grown);
+      cap = grown;
+    }
+    memcpy(data + size, start, n);
+    size += n;
+    if (end == NULL) {
+      continue;
+    }
+    // LF: drop the CR of a CRLF line end, which may have come in the
+    // previous buffer
+    if (size > seq_line && data[size - 1] == CR) {
+      size--;
+    }
+    if (in_header) {
+      name_len = size;
+      data[size++] = '\0';
+      named = 1;
+    }
+    in_header = 0;
+    line_start = 1;
+    seq_line = size;
+  }
+  if (size > seq_line && data[size - 1] == CR) {
+    size--;
+  }
+  if (in_header) {
+    name_len = size;
+    data[size++] = '\0';
+    named = 1;
+  }
+  if (!named) {
+    // bases before any header make a record without a name
+    memmove(data + 1, data, size);
+    data[0] = '\0';
+    size++;
+  }
+  size_t len = size - name_len - 1;
+  if (eof && !len) {
+    debug("finish read fasta file: %s\n", file->path);
+    arenaGrow(batch->arena, data, cap, 0);
+    batch->size--;
+    handle->close(file);
+    return NULL;
+  }
+  data = arenaGrow(batch->arena, data, cap, size + 1);
+  data[size] = '\0';
+  seq->name = data;
+  seq->seq = data + name_len + 1;
+  seq->qual = NULL;
+  seq->len = len;
+  seq->cap = len;
+  batch->bases += len;
+  return seq;
+}
+
+// Reads FASTA records a batch at a time. seq_reader_start() reads the next
+// batch on a background thread, so the caller can work on the previous one
+// in the meantime; seq_reader_wait() collects it.
+typedef struct {
+  XFileHandle handle;
+  XFile* file; // NULL once the input is exhausted
+  pthread_t thread;
+  MemTag tag; // of the opener, charged for what the thread allocates
+  int pending;
+  SeqBatch* next;
+  size_t max_records;
+  size_t max_bases;
+} SeqReader;
+
+static inline SeqReader*
+seq_reader_open(const char* path)
+{
+  SeqReader* reader = dmalloc(sizeof(SeqReader));
+  reader->handle = choice_handle(path);
+  reader->file = reader->handle.open(path, "rb");
+  if (reader->file == NULL) {
+    fprintf(stderr, "Open file: %s failed.\n", path);
+    exit(1);
+  }
+  reader->handle.readahead(reader->file);
+  reader->tag = memTag();
+  reader->pending = 0;
+  reader->next = NULL;
+  return reader;
+}
+
+// Replace the records of batch with the next ones, stopping after
+// max_records records or once max_bases bases were read (0: no limit).
+// Returns the number of records, 0 at the end of input.
+static inline size_t
+seq_reader_read(SeqReader* reader, SeqBatch* batch, size_t max_records,
+                size_t max_bases)
+{
+  seq_batch_clear(batch);
+  while (reader->file && (!max_records || batch->size < max_records)
+         && (!max_bases || batch->bases < max_bases)) {
+    if (__read_fasta(reader->file, &reader->handle, batch) == NULL) {
+      // __read_fasta closed the file
+      reader->file = NULL;
+      break;
+    }
+  }
+  return batch->size;
+}
+
+static void*
+__seq_reader_run(void* arg)
+{
+  SeqReader* reader = arg;
+  memSetThreadTag(reader->tag);
+  seq_reader_read(reader, reader->next, reader->max_records,
+                  reader->max_bases);
+  return NULL;
+}
+
+// start reading the next batch into batch, which must not be touched until
+// seq_reader_wait()
+static inline void
+seq_reader_start(SeqReader* reader, SeqBatch* batch, size_t max_records,
+                 size_t max_bases)
+{
+  reader->next = batch;
+  reader->max_records = max_records;
+  reader->max_bases = max_bases;
+  if (pthread_create(&reader->thread, NULL, __seq_reader_run, reader) != 0) {
+    __seq_reader_run(reader);
+    return;
+  }
+  reader->pending = 1;
+}
+
+// wait for the batch of seq_reader_start() and return its record count
+static inline size_t
+seq_reader_wait(SeqReader* reader)
+{
+  if (reader->pending) {
+    pthread_join(reader->thread, NULL);
+    reader->pending = 0;
+  }
+  return reader->next ? reader->next->size : 0;
+}
+
+static inline void
+seq_reader_close(SeqReader* reader)
+{
+  seq_reader_wait(reader);
+  if (reader->file) {
+    reader->handle.close(reader->file);
+  }
+  dfree(reader, sizeof(SeqReader));
+}
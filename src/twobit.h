@@ -0,0 +1,266 @@
+#pragma once
+#include "alloc.h"
+#include "log.h"
+#include "pack.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// UCSC .2bit files, mapped read only. Every record stores its bases packed
+// four to a byte, first base in the high bits, coded T0 C1 A2 G3, plus the
+// runs of N. twobitPack() turns a range of a record into a Packed buffer,
+// so index builds skip text parsing entirely: a 256 entry table converts
+// one byte (four bases) at a time and the N runs become the N mask.
+// Version 0 and 1 (64-bit offsets) files of either byte order are read.
+
+#define TWOBIT_SIGNATURE 0x1A412743U
+
+typedef struct {
+  char* name;
+  size_t size;              // bases
+  const unsigned char* dna; // (size + 3) / 4 bytes
+  uint32_t nblocks;
+  uint32_t* nstarts; // N runs, sorted by start
+  uint32_t* nsizes;
+} TwoBitRecord;
+
+typedef struct {
+  int fd;
+  const unsigned char* data;
+  size_t size;
+  int swap; // the file was written with the other byte order
+  TwoBitRecord* records;
+  size_t nrecords;
+} TwoBit;
+
+static inline uint32_t
+twobitU32(TwoBit* tb, size_t at)
+{
+  uint32_t v;
+  memcpy(&v, tb->data + at, sizeof(v));
+  return tb->swap ? __builtin_bswap32(v) : v;
+}
+
+static inline uint64_t
+twobitU64(TwoBit* tb, size_t at)
+{
+  uint64_t v;
+  memcpy(&v, tb->data + at, sizeof(v));
+  return tb->swap ? __builtin_bswap64(v) : v;
+}
+
+// byte of four bases to eight bits of our codes, first base in the low bits
+static inline const uint8_t*
+twobitTable()
+{
+  static uint8_t table[256];
+  static int ready = 0;
+  if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+    // T C A G to A0 C1 G2 T3
+    const uint8_t code[4] = { 3, 1, 0, 2 };
+    for (int b = 0; b < 256; b++) {
+      uint8_t v = 0;
+      for (int k = 0; k < 4; k++) {
+        v |= code[(b >> (6 - 2 * k)) & 3] << (2 * k);
+      }
+      table[b] = v;
+    }
+    __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+  }
+  return table;
+}
+
+static inline void
+twobitClose(TwoBit* tb)
+{
+  if (tb == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < tb->nrecords; i++) {
+    TwoBitRecord* r = tb->records + i;
+    dfree(r->name, strlen(r->name) + 1);
+    dfree(r->nstarts, sizeof(uint32_t) * (r->nblocks ? r->nblocks : 1));
+    dfree(r->nsizes, sizeof(uint32_t) * (r->nblocks ? r->nblocks : 1));
+  }
+  if (tb->records) {
+    dfree(tb->records, sizeof(TwoBitRecord) * tb->nrecords);
+  }
+  if (tb->data) {
+    munmap((void*)tb->data, tb->size);
+  }
+  close(tb->fd);
+  dfree(tb, sizeof(TwoBit));
+}
+
+static inline void
+twobitBroken(TwoBit* tb, const char* path)
+{
+  error("%s is not a valid .2bit file.", path);
+  twobitClose(tb);
+  exit(1);
+}
+
+// whether path starts with the .2bit signature, in either byte order
+static inline int
+istwobit(const char* path)
+{
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return 0;
+  }
+  uint32_t magic = 0;
+  size_t n = fread(&magic, sizeof(magic), 1, fp);
+  fclose(fp);
+  return n == 1
+         && (magic == TWOBIT_SIGNATURE
+             || magic == __builtin_bswap32(TWOBIT_SIGNATURE));
+}
+
+// map and read the record table of a .2bit file; exits on broken files
+static inline TwoBit*
+twobitOpen(const char* path)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    error("open %s failed. %s", path, strerror(errno));
+    exit(1);
+  }
+  TwoBit* tb = dmalloc(sizeof(TwoBit));
+  tb->fd = fd;
+  tb->size = st.st_size;
+  tb->data = NULL;
+  tb->records = NULL;
+  tb->nrecords = 0;
+  tb->swap = 0;
+  if (tb->size < 16) {
+    twobitBroken(tb, path);
+  }
+  void* data = mmap(NULL, tb->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    error("map %s failed. %s", path, strerror(errno));
+    exit(1);
+  }
+  tb->data = data;
+  tb->swap = twobitU32(tb, 0) != TWOBIT_SIGNATURE;
+  uint32_t version = twobitU32(tb, 4);
+  if (twobitU32(tb, 0) != TWOBIT_SIGNATURE || version > 1) {
+    twobitBroken(tb, path);
+  }
+  size_t count = twobitU32(tb, 8);
+  tb->records = dmalloc(sizeof(TwoBitRecord) * (count ? count : 1));
+  size_t at = 16;
+  for (size_t i = 0; i < count; i++) {
+    size_t width = version ? 8 : 4;
+    if (at + 1 > tb->size || at + 1 + tb->data[at] + width > tb->size) {
+      twobitBroken(tb, path);
+    }
+    size_t name_len = tb->data[at];
+    TwoBitRecord* r = tb->records + tb->nrecords++;
+    r->name = dmalloc(name_len + 1);
+    memcpy(r->name, tb->data + at + 1, name_len);
+    r->name[name_len] = '\0';
+    r->nblocks = 0;
+    r->nstarts = dmalloc(sizeof(uint32_t));
+    r->nsizes = dmalloc(sizeof(uint32_t));
+    at += 1 + name_len;
+    uint64_t offset = version ? twobitU64(tb, at) : twobitU32(tb, at);
+    at += width;
+    // dnaSize, nBlockCount, its starts and sizes, maskBlockCount, its
+    // starts and sizes, reserved, then the bases
+    if (offset + 8 > tb->size) {
+      twobitBroken(tb, path);
+    }
+    r->size = twobitU32(tb, offset);
+    uint32_t nblocks = twobitU32(tb, offset + 4);
+    size_t mask_at = offset + 8 + (size_t)nblocks * 8;
+    if (mask_at + 4 > tb->size) {
+      twobitBroken(tb, path);
+    }
+    size_t dna_at = mask_at + 4 + (size_t)twobitU32(tb, mask_at) * 8 + 4;
+    if (dna_at + (r->size + 3) / 4 > tb->size) {
+      twobitBroken(tb, path);
+    }
+    if (nblocks) {
+      r->nstarts = drealloc(r->nstarts, sizeof(uint32_t),
+                            sizeof(uint32_t) * nblocks);
+      r->nsizes = drealloc(r->nsizes, sizeof(uint32_t),
+                           sizeof(uint32_t) * nblocks);
+      r->nblocks = nblocks;
+      for (uint32_t b = 0; b < nblocks; b++) {
+        r->nstarts[b] = twobitU32(tb, offset + 8 + 4 * (size_t)b);
+        r->nsizes[b] = twobitU32(tb, offset + 8 + 4 * ((size_t)nblocks + b));
+      }
+    }
+    r->dna = tb->data + dna_at;
+  }
+  madvise(data, tb->size, MADV_SEQUENTIAL);
+  // fill the table before threads share it
+  twobitTable();
+  return tb;
+}
+
+// eight bits of our codes for the four bases of byte i of r, 0 past the end
+static inline uint64_t
+twobitByte(TwoBitRecord* r, const uint8_t* table, size_t i)
+{
+  return i < (r->size + 3) / 4 ? table[r->dna[i]] : 0;
+}
+
+// pack bases [begin, begin + n) of r into p, which must have room for them
+static inline void
+twobitPack(TwoBitRecord* r, size_t begin, size_t n, Packed* p)
+{
+  const uint8_t* table = twobitTable();
+  size_t nbytes = (r->size + 3) / 4;
+  int shift = 2 * (begin & 3);
+  for (size_t w = 0; w < packCodeWords(n); w++) {
+    size_t first = (begin + w * 32) / 4;
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    if (first + 9 <= nbytes) {
+      for (int k = 0; k < 8; k++) {
+        lo |= (uint64_t)table[r->dna[first + k]] << (8 * k);
+      }
+      hi = table[r->dna[first + 8]];
+    } else {
+      for (int k = 0; k < 8; k++) {
+        lo |= twobitByte(r, table, first + k) << (8 * k);
+      }
+      hi = twobitByte(r, table, first + 8);
+    }
+    p->words[w] = shift ? (lo >> shift) | (hi << (64 - shift)) : lo;
+  }
+  memset(p->nmask, 0, sizeof(uint64_t) * packMaskWords(n));
+  // first N run that ends after begin
+  uint32_t left = 0;
+  uint32_t right = r->nblocks;
+  while (left < right) {
+    uint32_t mid = (left + right) / 2;
+    if ((size_t)r->nstarts[mid] + r->nsizes[mid] <= begin) {
+      left = mid + 1;
+    } else {
+      right = mid;
+    }
+  }
+  for (uint32_t b = left; b < r->nblocks && r->nstarts[b] < begin + n; b++) {
+    size_t from = r->nstarts[b] > begin ? r->nstarts[b] - begin : 0;
+    size_t to = (size_t)r->nstarts[b] + r->nsizes[b] - begin;
+    to = to < n ? to : n;
+    for (size_t i = from; i < to;) {
+      // whole mask words at once where the run covers them
+      if ((i & 63) == 0 && i + 64 <= to) {
+        p->nmask[i / 64] = ~0ULL;
+        i += 64;
+      } else {
+        p->nmask[i / 64] |= 1ULL << (i & 63);
+        i++;
+      }
+    }
+  }
+  p->len = n;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <string.h>
+
+#include "alloc.h"
+
+// Typed vectors that keep their elements inline, unlike Array which holds
+// pointers to separately allocated ones.
+//
+//   VEC_DEFINE(SegmentVec, Segment)
+//
+// defines the type SegmentVec { Segment* data; size_t size, capacity;
+// MemTag tag; } and static inline functions named after it:
+//   SegmentVecNew(capacity) / SegmentVecFree(vec)  heap allocated vector
+//   SegmentVecInit(vec) / SegmentVecRelease(vec)   vector embedded elsewhere
+//   SegmentVecReserve(vec, n)   room for at least n elements
+//   SegmentVecEmplace(vec)      append an uninitialised element, return it
+//   SegmentVecPush(vec, item)   append a copy of item
+//   SegmentVecAppend(vec, items, n)  append n elements at once
+//   SegmentVecClear(vec)        drop the elements, keep the storage
+// Memory goes through dmallocTag, charged to the stage that was current when
+// the vector was made, however late it grows or is freed. The vectors are
+// not thread safe, and growing one moves its elements.
+
+#define VEC_DEFINE(Name, T)                                                   \
+  typedef struct {                                                            \
+    T* data;                                                                  \
+    size_t size;                                                              \
+    size_t capacity;                                                          \
+    MemTag tag;                                                               \
+  } Name;                                                                     \
+                                                                              \
+  static inline void Name##Init(Name* vec)                                    \
+  {                                                                           \
+    vec->data = NULL;                                                         \
+    vec->size = 0;                                                            \
+    vec->capacity = 0;                                                        \
+    vec->tag = memTag();                                                      \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Release(Name* vec)                                 \
+  {                                                                           \
+    if (vec->data) {                                                          \
+      dfreeTag(vec->data, sizeof(T) * vec->capacity, vec->tag);               \
+    }                                                                         \
+    vec->data = NULL;                                                         \
+    vec->size = 0;                                                            \
+    vec->capacity = 0;                                                        \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Reserve(Name* vec, size_t n)                       \
+  {                                                                           \
+    if (n <= vec->capacity) {                                                 \
+      return;                                                                 \
+    }                                                                         \
+    size_t capacity = roundup(n);                                             \
+    if (vec->data) {                                                          \
+      vec->data = dreallocTag(vec->data, sizeof(T) * vec->capacity,           \
+                              sizeof(T) * capacity, vec->tag);                \
+    } else {                                                                  \
+      vec->data = dmallocTag(sizeof(T) * capacity, vec->tag);                 \
+    }                                                                         \
+    vec->capacity = capacity;                                                 \
+  }                                                                           \
+                                                                              \
+  static inline Name* Name##New(size_t capacity)                              \
+  {                                                                           \
+    Name* vec = dmalloc(sizeof(Name));                                        \
+    Name##Init(vec);                                                          \
+    Name##Reserve(vec, capacity);                                             \
+    return vec;                                                               \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Free(Name* vec)                                    \
+  {                                                                           \
+    if (vec == NULL) {                                                        \
+      return;                                                                 \
+    }                                                                         \
+    Name##Release(vec);                                                       \
+    dfreeTag(vec, sizeof(Name), vec->tag);                                    \
+  }                                                                           \
+                                                                              \
+  static inline T* Name##Emplace(Name* vec)                                   \
+  {                                                                           \
+    if (vec->size == vec->capacity) {                                         \
+      Name##Reserve(vec, vec->size + 1);                                      \
+    }                                                                         \
+    return vec->data + vec->size++;                                           \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Push(Name* vec, T item)                            \
+  {                                                                           \
+    *Name##Emplace(vec) = item;                                               \
+  }                                                                           \
+                                                                              \
+  static inline T* Name##Append(Name* vec, const T* items, size_t n)          \
+  {                                                                           \
+    Name##Reserve(vec, vec->size + n);                                        \
+    T* first = vec->data + vec->size;                                         \
+    if (n) {                                                                  \
+      memcpy(first, items, sizeof(T) * n);                                    \
+    }                                                                         \
+    vec->size += n;                                                           \
+    return first;                                                             \
+  }                                                                           \
+                                                                              \
+  static inline void Name##Clear(Name* vec)                                   \
+  {                                                                           \
+    vec->size = 0;                                                            \
+  }
@@ -0,0 +1,370 @@
+#!/bin/sh
+# Tests for one roa binary and the k it was built with:
+#   OMP_NUM_THREADS=4 sh test/run.sh test/roa 16
+#
+# Indexes and designs run on OMP_NUM_THREADS threads (4 by default) and must
+# match the known good results in expected/: k<k>.fa and k<k>.pair.fa are
+# the designs of data/query.fa against an index of data/ref1.fa, plain and
+# with -pairCheck 1, and k<k>.*.cksum the cksum of its bitmap. data/ holds
+# random sequences.
+
+set -u
+
+roa=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+k=$2
+data=$(cd "$(dirname "$0")/data" && pwd)
+expected=$(cd "$(dirname "$0")/expected" && pwd)
+threads=${OMP_NUM_THREADS:-4}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+# a directory with fresh fixtures, so no <ref>.index cache of an earlier
+# check is picked up
+fresh()
+{
+  rm -rf "$work/run"
+  mkdir "$work/run"
+  cp "$data"/* "$work/run"
+  cd "$work/run" || exit 1
+}
+
+# roa on $threads threads, or on one when the first argument is -1; its
+# output is left in $work/out
+run()
+{
+  t=$threads
+  if [ "$1" = "-1" ]; then
+    t=1
+    shift
+  fi
+  if ! OMP_NUM_THREADS=$t "$roa" "$@" > "$work/out" 2> "$work/log"; then
+    echo "FAIL roa $*"
+    cat "$work/out" "$work/log"
+    failed=1
+    return 1
+  fi
+  if grep "memory accounting" "$work/log"; then
+    echo "FAIL roa $*"
+    failed=1
+    return 1
+  fi
+}
+
+check()
+{
+  if cmp -s "$2" "$3"; then
+    echo "ok   $1"
+  else
+    echo "FAIL $1"
+    failed=1
+  fi
+}
+
+# designs of query.fa against index $1 in $work/$2.fa and, with -pairCheck
+# 1, in $work/$2.pair.fa; the other arguments go to both
+design()
+{
+  idx=$1
+  out=$2
+  shift 2
+  run design -i "$idx" -q query.fa -o "$work/$out.fa" "$@" &&
+    run design -i "$idx" -q query.fa -o "$work/$out.pair.fa" -pairCheck 1 "$@"
+}
+
+check_design()
+{
+  check "$1 design" "$expected/k$k.fa" "$work/$2.fa"
+  check "$1 design -pairCheck" "$expected/k$k.pair.fa" "$work/$2.pair.fa"
+}
+
+# the cksum of file $2 is the expected $3 one
+check_cksum()
+{
+  cksum < "$2" > "$work/cksum"
+  check "$1" "$expected/k$k.$3.cksum" "$work/cksum"
+}
+
+# index $1 loaded back as the cached index of x.fa and written raw to
+# $work/$2.idx; the other arguments go to index
+to_raw()
+{
+  ln -s "$PWD/$1" x.fa.index
+  : > x.fa
+  out=$2
+  shift 2
+  run index -format raw "$@" "$work/$out.idx" x.fa
+  rm -f x.fa x.fa.index
+}
+
+# an index of reference $2 holds the kmers of ref1.fa
+check_ref()
+{
+  run index -format raw idx "$2" && design idx ref && check_design "$1" ref &&
+    if [ $k -le 16 ]; then
+      check_cksum "$1 bitmap" idx raw
+    fi
+}
+
+# One thread and many build the same index, and it designs the expected
+# probes.
+fresh
+run -1 index -format raw one.idx ref1.fa && cp one.idx "$work/ref1.idx" &&
+  design one.idx one && check_design "index on one thread" one
+if [ $k -le 16 ]; then
+  check_cksum "index on one thread bitmap" one.idx raw
+fi
+fresh
+run index -format raw idx ref1.fa && design idx idx &&
+  check_design "index on $threads threads" idx
+if [ $k -le 16 ]; then
+  check_cksum "index on $threads threads bitmap" idx raw
+  fresh
+  run -1 index -format raw -t 2 idx ref1.fa &&
+    check_cksum "index -t 2 bitmap" idx raw
+fi
+
+# Raw indexes are mapped as they are, sparse and hash indexes are sets of
+# the kmers present, bucketed builds sort the kmers before they write them
+# and canonical indexes only keep the smaller strand of each. All of them
+# load back as the cached index of a reference and convert to any other.
+# Above k = 16 there are only hash indexes.
+reprs="dense sparse hash"
+if [ $k -gt 16 ]; then
+  reprs=hash
+fi
+for format in gz raw; do
+  for repr in $reprs; do
+    for build in direct bucket; do
+      for canonical in 0 1; do
+        opts="-format $format -repr $repr -build $build -canonical $canonical"
+        fresh
+        run index $opts idx ref1.fa && design idx idx &&
+          check_design "index $opts" idx
+        if [ $k -le 16 ] && [ -f idx ]; then
+          bitmap=raw
+          if [ $canonical = 1 ]; then
+            bitmap=canonical
+          fi
+          to_raw idx raw -repr dense -canonical $canonical &&
+            check_cksum "index $opts bitmap" "$work/raw.idx" $bitmap
+        fi
+      done
+    done
+  done
+done
+
+# bench builds the index in every dense mode
+if [ $k -le 16 ]; then
+  fresh
+  run bench ref1.fa && echo "ok   bench"
+fi
+
+# gz indexes are zlib blocks at any level
+for level in 0 9; do
+  fresh
+  run index -level $level idx ref1.fa && design idx idx &&
+    check_design "index -level $level" idx
+  if [ $k -le 16 ] && [ -f idx ]; then
+    to_raw idx raw &&
+      check_cksum "index -level $level bitmap" "$work/raw.idx" raw
+  fi
+done
+
+# A membership index designs like a plain index of all its references, and
+# with -exclude like an index of the excluded ones alone. It is dense, so
+# only up to k = 16.
+if [ $k -le 16 ]; then
+  fresh
+  run -1 index -format raw both.idx ref1.fa ref2.fa && design both.idx both
+  fresh
+  if run index -membership 1 m.idx ref1.fa ref2.fa; then
+    design m.idx m &&
+      check "membership design" "$work/both.fa" "$work/m.fa" &&
+      check "membership design -pairCheck" "$work/both.pair.fa" \
+        "$work/m.pair.fa"
+    design m.idx x -exclude ref1.fa && check_design "membership -exclude" x
+  fi
+fi
+
+# Placement policies only move the index; pages that cannot be had fall
+# back to plain ones.
+fresh
+for mem in none thp hugetlb thp,interleave; do
+  design "$work/ref1.idx" mem -mem $mem && check_design "design -mem $mem" mem
+done
+run bench -i "$work/ref1.idx" -n 100000 -mem thp && echo "ok   bench -i"
+
+# Bases pack the same in either case.
+fresh
+sed '/^>/!y/acgt/ACGT/' ref1.fa > upper.fa
+check_ref "upper case reference" upper.fa
+fresh
+sed '/^>/!y/ACGT/acgt/' ref1.fa > lower.fa
+check_ref "lower case reference" lower.fa
+
+# Any line length and ending reads the same.
+wrap()
+{
+  awk -v w=$1 '
+    /^>/ { if (seq != "") emit(); print; next }
+    { seq = seq $0 }
+    END { emit() }
+    function emit() {
+      for (i = 1; i <= length(seq); i += w) print substr(seq, i, w)
+      seq = ""
+    }' ref1.fa
+}
+fresh
+wrap 13 > short.fa
+check_ref "13 column reference" short.fa
+fresh
+wrap 100000 > long.fa
+check_ref "one line records" long.fa
+fresh
+awk '{ printf "%s\r\n", $0 }' ref1.fa > crlf.fa
+check_ref "CRLF reference" crlf.fa
+fresh
+printf %s "$(cat ref1.fa)" > nonl.fa
+check_ref "reference without a last newline" nonl.fa
+
+fresh
+check_ref "gzip reference" ref1.fa.gz
+
+fresh
+check_ref "bgzip reference" ref1.fa.bgz
+
+# Plain references are mapped. A last line without a newline that ends on a
+# page must not be read past.
+fresh
+head -c 8192 ref1.fa > page.fa
+gzip -c page.fa > page.fa.gz
+run index -format raw page.idx page.fa && design page.idx page &&
+  run index -format raw gz.idx page.fa.gz && design gz.idx gz &&
+  check "reference ending on a page design" "$work/gz.fa" "$work/page.fa" &&
+  if [ $k -le 16 ]; then
+    check "reference ending on a page bitmap" gz.idx page.idx
+  fi
+
+# Records are read in batches; two of them in one file index like two
+# files.
+fresh
+cat ref1.fa ref2.fa > both.fa
+run -1 index -format raw two.idx ref1.fa ref2.fa && design two.idx two &&
+  run index -format raw both.idx both.fa && design both.idx both &&
+  check "records of one file design" "$work/two.fa" "$work/both.fa" &&
+  if [ $k -le 16 ]; then
+    check "records of one file bitmap" two.idx both.idx
+  fi
+
+# faidx writes a samtools .fai, which design then uses to load the records
+# one at a time, and prints records or ranges of them.
+fresh
+run faidx query.fa && check "faidx .fai" "$expected/query.fa.fai" query.fa.fai
+run faidx query.fa gene1 gene2:101-200 && cp "$work/out" "$work/faidx.fa" &&
+  check "faidx records" "$expected/faidx.fa" "$work/faidx.fa"
+design "$work/ref1.idx" fai && check_design "design with a .fai" fai &&
+  check "design keeps the .fai" "$expected/query.fa.fai" query.fa.fai
+gzip query.fa
+run design -i "$work/ref1.idx" -q query.fa.gz -o "$work/gz.fa" &&
+  check "gzip query design" "$expected/k$k.fa" "$work/gz.fa"
+# -names designs like a query of the named records alone
+fresh
+run faidx query.fa gene0 gene2 && cp "$work/out" "$work/sub.fa"
+design "$work/ref1.idx" names -names gene2,gene0
+fresh
+cp "$work/sub.fa" query.fa
+design "$work/ref1.idx" sub &&
+  check "design -names" "$work/sub.fa" "$work/names.fa" &&
+  check "design -names -pairCheck" "$work/sub.pair.fa" "$work/names.pair.fa"
+
+# Outputs are buffered, and compressed for a .gz path.
+fresh
+run design -i "$work/ref1.idx" -q query.fa -o "$work/out.fa.gz" &&
+  gzip -dc "$work/out.fa.gz" > "$work/gz.fa" &&
+  check "design -o out.fa.gz" "$expected/k$k.fa" "$work/gz.fa"
+
+# Pipes: references and queries on stdin, results on stdout. tsv and
+# ndjson records do not depend on the threads.
+fresh
+check_ref "reference on stdin" - < ref1.fa
+fresh
+check_ref "gzip reference on stdin" - < ref1.fa.gz
+fresh
+run design -i "$work/ref1.idx" -q - -o - < query.fa &&
+  check "design -q - -o -" "$expected/k$k.fa" "$work/out"
+for outfmt in tsv ndjson; do
+  run -1 design -i "$work/ref1.idx" -q query.fa -outfmt $outfmt \
+    -o "$work/one.$outfmt" &&
+    run design -i "$work/ref1.idx" -q query.fa -outfmt $outfmt \
+      -o "$work/out.$outfmt" &&
+    check "design -outfmt $outfmt" "$work/one.$outfmt" "$work/out.$outfmt"
+done
+
+fresh
+check_ref "2bit reference" ref1.2bit
+
+# Indexes that are truncated or have a forged header are refused instead
+# of read past their data.
+forge()
+{
+  cp "$1" bad.idx &&
+    printf "$3" | dd of=bad.idx bs=1 seek=$2 conv=notrunc 2> /dev/null
+}
+refused()
+{
+  OMP_NUM_THREADS=1 "$roa" design -i bad.idx -q query.fa \
+    -o "$work/bad.fa" > /dev/null 2>&1
+  if [ $? = 1 ]; then
+    echo "ok   $1 refused"
+  else
+    echo "FAIL $1 refused"
+    failed=1
+  fi
+}
+fresh
+head -c 300 "$work/ref1.idx" > bad.idx
+refused "truncated index"
+forge "$work/ref1.idx" 16 '\003'
+refused "index of 3 bit slots"
+if [ $k -le 16 ]; then
+  # 8 slots, in one byte
+  forge "$work/ref1.idx" 24 '\010\000\000\000\000\000\000\000\001'
+  refused "dense index of 8 slots"
+  run -1 index -format raw -membership 1 m.idx ref1.fa ref2.fa &&
+    forge m.idx 271 x && refused "membership index of an unterminated name"
+fi
+# The container offsets of a sparse index must not run backwards or past
+# its words.
+if [ $k -le 16 ]; then
+  fresh
+  run -1 index -format raw -repr sparse s.idx ref1.fa &&
+    forge s.idx $((4096 + 4 * 100)) '\377\377\377\177' &&
+    refused "sparse index of decreasing offsets" &&
+    forge s.idx $((4096 + 4 * 65536)) '\377\377\377\177' &&
+    refused "sparse index of offsets past its words"
+fi
+
+# A last header without a newline that ends on a page is read up to the
+# end of the mapping and no further.
+fresh
+name=$(head -c $((4095 - $(wc -c < query.fa))) /dev/zero | tr '\0' a)
+printf '>%s' "$name" >> query.fa
+printf '%s\t0\t4096\t0\t0\n' "$name" > "$work/last.fai"
+run faidx query.fa && tail -n 1 query.fa.fai > "$work/fai" &&
+  check "faidx last header on a page" "$work/last.fai" "$work/fai"
+
+# Records are parsed into the arena of their batch. One larger than an
+# arena chunk grows out of it, and holds the kmers of two copies.
+fresh
+awk '!/^>/ { s = s $0 } END { print ">two"; print s s }' ref1.fa > two.fa
+awk '!/^>/ { s = s $0 }
+  END { print ">many"; for (i = 0; i < 300; i++) print s }' ref1.fa > many.fa
+run -1 index -format raw two.idx two.fa && design two.idx two &&
+  run index -format raw many.idx many.fa && design many.idx many &&
+  check "record larger than a chunk design" "$work/two.fa" "$work/many.fa" &&
+  if [ $k -le 16 ]; then
+    check "record larger than a chunk bitmap" two.idx many.idx
+  fi
+
+exit $failed